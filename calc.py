@@ -16,6 +16,7 @@ keys = {
 	"maxtotalmem":		Tplain,
 	"minchainentries":	Tpow2range,
 	"minmaxblocksperhead":	Tinterval,
+	"alignment":		Tplain,
 }
 
 def log2(n):
@@ -92,7 +93,7 @@ def warn(s):
 
 def usage(prog):
 	usagestr = "usage: %s maxdatafile start-end blocksize start-end collisioninterval start-end" + \
-		" [maxinitmem size] [maxtotalmem size] [minchainentries start-end] [minmaxblocksperhead start-end]"
+		" [maxinitmem size] [maxtotalmem size] [minchainentries start-end] [minmaxblocksperhead start-end] [alignment size]"
 	print >>sys.stderr, usagestr % prog
 	sys.exit(1)
 
@@ -145,9 +146,10 @@ def main(prog, *args):
 		maxtotalmem =		cfg["maxtotalmem"]
 		minchainentries =	cfg["minchainentries"]
 		minmaxblocksperhead =	cfg["minmaxblocksperhead"]
+		alignment =		cfg["alignment"] or 1
 		
 		totalblocks = maxdatafile / blocksize
-		addrwidth = int(0.9 + round(log2(maxdatafile), 1))
+		addrwidth = int(0.9 + round(log2(maxdatafile/alignment), 1))
 		totalscorewidth = int(0.9 + log2(totalblocks)) + int(0.9 + round(abs(log2(1.0/collisioninterval)), 1))
 
 		result = {
@@ -0,0 +1,533 @@
+#include "memventi.h"
+
+
+enum {
+	Reportmax	= 32,
+};
+
+typedef struct Ient Ient;
+typedef struct Ifile Ifile;
+
+/* an index entry, with its shard and position in the indexfile of the shard */
+struct Ient {
+	uvlong offset;
+	int shard;
+	uvlong pos;
+	uchar buf[Diskiheadersize];
+};
+
+/* the indexfile of a shard */
+struct Ifile {
+	char name[PATH_MAX];
+	char newname[PATH_MAX+8];
+	uvlong size;
+	FILE *newf;
+};
+
+struct syslog_data sdata = SYSLOG_DATA_INIT;
+
+static int tflag;
+static int uflag;
+static int xflag;
+
+static char *datafiles[Devmax];
+static int ndatafiles;
+static char *indexfile = "index";
+static int segshift;
+static Data disk;
+static Ifile *ifiles;
+static int nshards;
+static int shardbits;
+static Ient *ients;
+static uvlong nients;
+static uvlong ienti;
+static uvlong *segindexend;
+
+static uvlong nvalid;
+static uvlong ninvalid;
+static uvlong validbytes;
+static uvlong validend;
+static uvlong *segvalidend;
+static uvlong nbadranges;
+static uvlong badstart, badlen;
+static char *badmsg;
+
+static uvlong nindex;
+static uvlong nmismatch;
+static uvlong nextra;
+static uvlong nmissing;
+static uvlong nunindexed;
+
+static uchar *ihs;
+static uvlong nihs;
+static uvlong nihsalloc;
+static uvlong ndups;
+
+
+static void
+flushbad(void)
+{
+	if(badlen == 0)
+		return;
+	printf("data: %llu bytes at offset=%llu: %s\n", badlen, badstart, badmsg);
+	nbadranges++;
+	badlen = 0;
+}
+
+
+static int
+ientcmp(const void *a, const void *b)
+{
+	const Ient *ia = a, *ib = b;
+
+	if(ia->offset != ib->offset)
+		return ia->offset < ib->offset ? -1 : 1;
+	if(ia->shard != ib->shard)
+		return ia->shard-ib->shard;
+	return ia->pos < ib->pos ? -1 : ia->pos > ib->pos;
+}
+
+
+/*
+ * read the indexfiles into memory, sorted on datafile offset.  with
+ * multiple writers the entries of the segments are interleaved in the
+ * indexfiles.  also find the end of the last indexed block of each
+ * segment.
+ */
+static void
+readindex(void)
+{
+	uchar *buf;
+	IHeader ih;
+	Ifile *f;
+	Ient *e;
+	uvlong off, n, i;
+	ssize_t r;
+	int fd, seg, k;
+
+	segindexend = emalloc(sizeof segindexend[0] * MAX(1, disk.nsegs));
+	for(i = 0; i < disk.nsegs; i++)
+		segindexend[i] = (uvlong)i<<segshift;
+
+	buf = emalloc(Scanchunksize);
+	for(k = 0; k < nshards; k++) {
+		f = &ifiles[k];
+		fd = open(f->name, O_RDONLY);
+		if(fd < 0 && errno == ENOENT)
+			continue;
+		if(fd < 0)
+			err(1, "opening indexfile %s", f->name);
+		f->size = filesize(fd);
+		if(f->size % Diskiheadersize != 0)
+			printf("index: %s size %llu not multiple of index header size (%d)\n",
+				f->name, f->size, (int)Diskiheadersize);
+
+		n = f->size/Diskiheadersize;
+		ients = erealloc(ients, sizeof ients[0] * MAX(1, nients+n));
+		for(off = 0; off < n*Diskiheadersize; off += r) {
+			r = preadn(fd, buf, MIN(Scanchunksize, n*Diskiheadersize-off), off);
+			if(r <= 0 || r % Diskiheadersize != 0)
+				err(1, "reading indexfile %s at offset=%llu", f->name, off);
+			for(i = 0; i < r; i += Diskiheadersize) {
+				e = &ients[nients++];
+				memcpy(e->buf, buf+i, Diskiheadersize);
+				unpackiheader(e->buf, &ih);
+				e->offset = ih.offset;
+				e->shard = k;
+				e->pos = (off+i)/Diskiheadersize;
+				if(getuvlong(ih.indexscore, 0, shardbits) != k)
+					printf("index: entry at offset=%llu in %s belongs to shard %d\n",
+						off+i, f->name, (int)getuvlong(ih.indexscore, 0, shardbits));
+				seg = segshift == 0 ? 0 : ih.offset>>segshift;
+				if(seg < disk.nsegs && ih.offset+1 > segindexend[seg])
+					segindexend[seg] = ih.offset+1;
+			}
+		}
+		close(fd);
+	}
+	free(buf);
+	qsort(ients, nients, sizeof ients[0], ientcmp);
+}
+
+
+static void
+reportextra(Ient *e)
+{
+	IHeader ih;
+
+	if(nextra++ < Reportmax) {
+		unpackiheader(e->buf, &ih);
+		printf("index: entry at offset=%llu in %s claims block at offset=%llu type=%d, datafile has no block there\n",
+			e->pos*Diskiheadersize, ifiles[e->shard].name, ih.offset, (int)ih.type);
+	} else if(nextra == Reportmax+1)
+		printf("index: further entries without block not shown\n");
+}
+
+
+/*
+ * compare the index entries for the block at offset.  the index may
+ * lack entries for blocks with an invalid score (e.g. after -x).
+ * entries for blocks after the last indexed block of a segment are
+ * added by memventi at startup, others can only be restored with -x.
+ */
+static void
+checkindex(uchar *want, uvlong offset, int invalid)
+{
+	Ient *e;
+	IHeader ih;
+	int found, seg;
+
+	while(ienti < nients && ients[ienti].offset < offset)
+		reportextra(&ients[ienti++]);
+
+	found = 0;
+	for(; ienti < nients && ients[ienti].offset == offset; ienti++) {
+		e = &ients[ienti];
+		nindex++;
+		if(!found && memcmp(e->buf, want, Diskiheadersize) == 0) {
+			found = 1;
+			continue;
+		}
+		if(nmismatch++ < Reportmax) {
+			unpackiheader(e->buf, &ih);
+			printf("index: entry at offset=%llu in %s claims block at offset=%llu type=%d, datafile has other block there\n",
+				e->pos*Diskiheadersize, ifiles[e->shard].name, ih.offset, (int)ih.type);
+		} else if(nmismatch == Reportmax+1)
+			printf("index: further mismatches not shown\n");
+	}
+	if(found || invalid)
+		return;
+	seg = segshift == 0 ? 0 : offset>>segshift;
+	if(offset >= segindexend[seg]) {
+		nmissing++;
+		return;
+	}
+	if(nunindexed++ < Reportmax)
+		printf("index: no entry for block at offset=%llu\n", offset);
+	else if(nunindexed == Reportmax+1)
+		printf("index: further blocks without entry not shown\n");
+}
+
+
+static void
+checkblock(Scan *s, Scanblock *b)
+{
+	IHeader ih;
+	Ifile *f;
+	uchar ihbuf[Diskiheadersize];
+
+	if(b->data == nil) {
+		if(badlen > 0 && badstart+badlen == b->offset && badmsg == b->err) {
+			badlen += b->len;
+			return;
+		}
+		flushbad();
+		badstart = b->offset;
+		badlen = b->len;
+		badmsg = b->err;
+		return;
+	}
+	flushbad();
+
+	toiheader(&ih, &b->dh, b->offset);
+	packiheader(ihbuf, &ih);
+	checkindex(ihbuf, b->offset, b->err != nil);
+
+	if(b->err != nil) {
+		printf("data: block at offset=%llu %s: %s\n", b->offset, dheaderfmt(&b->dh), b->err);
+		ninvalid++;
+		return;
+	}
+
+	nvalid++;
+	validbytes += b->len;
+	validend = b->offset+b->len;
+
+	/* blocks with an invalid score are left out, a client can write them again */
+	if(xflag) {
+		f = &ifiles[getuvlong(b->dh.score, 0, shardbits)];
+		if(fwrite(ihbuf, 1, sizeof ihbuf, f->newf) != sizeof ihbuf)
+			err(1, "writing new indexfile %s", f->newname);
+	}
+
+	if(uflag) {
+		if(nihs == nihsalloc) {
+			nihsalloc = MAX(1024, 2*nihsalloc);
+			ihs = erealloc(ihs, nihsalloc*Diskiheadersize);
+		}
+		memcpy(ihs+nihs*Diskiheadersize, ihbuf, Diskiheadersize);
+		nihs++;
+	}
+}
+
+
+static int
+ihcmp(const void *a, const void *b)
+{
+	return memcmp(a, b, Indexscoresize+1);
+}
+
+
+static void
+readdheader(IHeader *ih, DHeader *dh)
+{
+	uchar buf[Diskdheadersize];
+
+	if(dataread(&disk, buf, sizeof buf, ih->offset) != sizeof buf || unpackdheader(buf, dh) != nil)
+		errx(1, "rereading header at offset=%llu", ih->offset);
+}
+
+
+static void
+finddups(void)
+{
+	uvlong i, j, k, l;
+	IHeader a, b;
+	DHeader da, db;
+
+	qsort(ihs, nihs, Diskiheadersize, ihcmp);
+	for(i = 0; i < nihs; i = j) {
+		for(j = i+1; j < nihs; j++)
+			if(ihcmp(ihs+i*Diskiheadersize, ihs+j*Diskiheadersize) != 0)
+				break;
+		for(k = i; k+1 < j; k++) {
+			unpackiheader(ihs+k*Diskiheadersize, &a);
+			readdheader(&a, &da);
+			for(l = k+1; l < j; l++) {
+				unpackiheader(ihs+l*Diskiheadersize, &b);
+				readdheader(&b, &db);
+				if(memcmp(da.score, db.score, Scoresize) != 0)
+					continue;
+				printf("data: duplicate block %s at offset=%llu and offset=%llu\n",
+					dheaderfmt(&da), a.offset, b.offset);
+				ndups++;
+			}
+		}
+	}
+}
+
+
+static int
+ientposcmp(const void *a, const void *b)
+{
+	const Ient *ia = a, *ib = b;
+
+	if(ia->shard != ib->shard)
+		return ia->shard-ib->shard;
+	return ia->pos < ib->pos ? -1 : ia->pos > ib->pos;
+}
+
+
+static void
+createnew(Ifile *f)
+{
+	snprintf(f->newname, sizeof f->newname, "%s.new", f->name);
+	f->newf = fopen(f->newname, "w");
+	if(f->newf == nil)
+		err(1, "creating new indexfile %s", f->newname);
+}
+
+
+static void
+commitnew(Ifile *f)
+{
+	if(fflush(f->newf) != 0 || fsync(fileno(f->newf)) != 0 || fclose(f->newf) != 0)
+		err(1, "writing new indexfile %s", f->newname);
+	f->newf = nil;
+	if(rename(f->newname, f->name) != 0)
+		err(1, "renaming %s to %s", f->newname, f->name);
+}
+
+
+/* drop index entries for blocks past the last valid block of their segment */
+static void
+truncateindex(void)
+{
+	uvlong i, j, first, n;
+	int seg, k;
+	Ifile *f;
+
+	qsort(ients, nients, sizeof ients[0], ientposcmp);
+	i = 0;
+	for(k = 0; k < nshards; k++) {
+		f = &ifiles[k];
+		first = i;
+		n = 0;
+		for(; i < nients && ients[i].shard == k; i++) {
+			seg = segshift == 0 ? 0 : ients[i].offset>>segshift;
+			if(seg < disk.nsegs && ients[i].offset < segvalidend[seg])
+				ients[first+n++] = ients[i];
+		}
+		if(n == i-first && f->size % Diskiheadersize == 0)
+			continue;
+
+		createnew(f);
+		for(j = first; j < first+n; j++)
+			if(fwrite(ients[j].buf, 1, Diskiheadersize, f->newf) != Diskiheadersize)
+				err(1, "writing new indexfile %s", f->newname);
+		commitnew(f);
+		printf("index: removed %llu entries from %s, %llu left\n", i-first-n, f->name, n);
+	}
+}
+
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: memventi-check [-tuxD] [-j nproc] [-i indexfile] [-d datafile ...] [-s segmentsize]\n");
+	exit(1);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	int ch;
+	int nproc;
+	int problems;
+	int i;
+	Meta meta;
+	char *errmsg;
+	Scan s;
+	Dataseg *seg;
+	uvlong start, base;
+	char name[PATH_MAX];
+
+	nproc = sysconf(_SC_NPROCESSORS_ONLN);
+	while((ch = getopt(argc, argv, "Dd:i:j:s:tux")) != -1) {
+		switch(ch) {
+		case 'D':
+			debugflag = 1;
+			break;
+		case 'd':
+			if(ndatafiles == nelem(datafiles))
+				errx(1, "too many datafiles specified");
+			datafiles[ndatafiles++] = optarg;
+			break;
+		case 'i':
+			indexfile = optarg;
+			break;
+		case 'j':
+			nproc = atoi(optarg);
+			if(nproc <= 0)
+				usage();
+			break;
+		case 's':
+			segshift = parsesegsize(optarg);
+			if(segshift < 0)
+				errx(1, "invalid segment size %s", optarg);
+			break;
+		case 't':
+			tflag = 1;
+			break;
+		case 'u':
+			uflag = 1;
+			break;
+		case 'x':
+			xflag = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if(argc != 0)
+		usage();
+	if(nproc <= 0)
+		nproc = 1;
+	if(ndatafiles == 0)
+		datafiles[ndatafiles++] = "data";
+
+	openlog_r("memventi-check", LOG_PERROR, LOG_DAEMON, &sdata);
+
+	snprintf(name, sizeof name, "%s.meta", indexfile);
+	errmsg = metaread(name, &meta);
+	if(errmsg != nil)
+		errx(1, "%s", errmsg);
+	nshards = meta.nshards;
+	for(shardbits = 0; (1<<shardbits) < nshards; shardbits++)
+		;
+	ifiles = emalloc(sizeof ifiles[0] * nshards);
+	for(i = 0; i < nshards; i++) {
+		if(nshards == 1)
+			snprintf(ifiles[i].name, sizeof ifiles[i].name, "%s", indexfile);
+		else
+			snprintf(ifiles[i].name, sizeof ifiles[i].name, "%s.%d", indexfile, i);
+		ifiles[i].size = 0;
+		ifiles[i].newf = nil;
+	}
+
+	dataopen(&disk, datafiles, ndatafiles, segshift, 0);
+	readindex();
+	segvalidend = emalloc(sizeof segvalidend[0] * MAX(1, disk.nsegs));
+
+	if(xflag)
+		for(i = 0; i < nshards; i++)
+			createnew(&ifiles[i]);
+
+	start = msec();
+	for(i = 0; i < disk.nsegs; i++) {
+		segvalidend[i] = ~0ULL;
+		if(disk.segs[i].fd < 0)
+			continue;
+		validend = (uvlong)i<<segshift;
+		memset(&s, 0, sizeof s);
+		s.fd = disk.segs[i].fd;
+		s.start = 0;
+		s.end = disk.segs[i].size;
+		s.base = (uvlong)i<<segshift;
+		s.nproc = nproc;
+		s.fn = checkblock;
+		if(!scan(&s)) {
+			for(i = 0; xflag && i < nshards; i++)
+				unlink(ifiles[i].newname);
+			errx(1, "%s", s.err);
+		}
+		flushbad();
+		segvalidend[i] = validend;
+	}
+
+	while(ienti < nients)
+		reportextra(&ients[ienti++]);
+	if(nextra > 0)
+		printf("index: %llu entries without block in datafile\n", nextra);
+	if(nunindexed > 0)
+		printf("index: lacks %llu entries for blocks before the last indexed block of their segment\n", nunindexed);
+	if(nmissing > 0)
+		printf("index: lacks %llu entries for last blocks in datafile, memventi adds them at startup\n", nmissing);
+
+	if(uflag)
+		finddups();
+
+	printf("%llu valid blocks (%llu bytes), %llu invalid blocks, %llu unusable ranges, "
+		"%llu index mismatches, %llu duplicates, in %.3fs\n",
+		nvalid, validbytes, ninvalid, nbadranges, nmismatch, ndups, (msec()-start)/1000.0);
+	problems = ninvalid > 0 || nbadranges > 0 || nmismatch > 0 || nextra > 0 || nunindexed > 0 || ndups > 0;
+	for(i = 0; i < nshards; i++)
+		if(ifiles[i].size % Diskiheadersize != 0)
+			problems = 1;
+
+	if(tflag) {
+		for(i = 0; i < disk.nsegs; i++) {
+			seg = &disk.segs[i];
+			base = (uvlong)i<<segshift;
+			if(seg->fd < 0 || base+seg->size <= segvalidend[i])
+				continue;
+			dataname(&disk, i, name, sizeof name);
+			if(truncate(name, segvalidend[i]-base) != 0)
+				err(1, "truncating datafile %s", name);
+			printf("data: truncated %s to %llu bytes, removed %llu bytes after last valid block\n",
+				name, segvalidend[i]-base, base+seg->size-segvalidend[i]);
+		}
+		if(!xflag)
+			truncateindex();
+	}
+
+	if(xflag) {
+		for(i = 0; i < nshards; i++)
+			commitnew(&ifiles[i]);
+		printf("index: rebuilt with %llu entries\n", nvalid);
+	}
+	return problems ? 1 : 0;
+}
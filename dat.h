@@ -14,10 +14,6 @@ enum {
 	Diskiheadersize	= Indexscoresize+1+6,
 	Diskdheadersize	= Magicsize+Scoresize+1+2,
 
-	Chainentriesmin	= 8,
-	Bufallocsize	= 1*1024*1024,
-	Chainallocn	= 8*1024,
-
 	Datamax		= 56 * 1024,
 	Stringmax	= 1024,
 
@@ -57,6 +53,31 @@ enum {
 	Rwrite,
 	Tsync,
 	Rsync,
+
+	/*
+	 * extension, enabled for clients listing Codecbatch in Thello.
+	 * each read or write is answered with its own Rread, Rwrite or
+	 * Rerror, in order and with the tag of the batch.
+	 */
+	Tmread		= 64,	/* n[2] (score[20] type[1] pad[1] count[2])[n] */
+	Tmwrite		= 66,	/* n[2] (type[1] pad[1] size[2] data[size])[n] */
+	Tmhave		= 68,	/* n[2] (score[20] type[1] pad[1])[n] */
+	Rmhave,		/* n[2] bits[(n+7)/8], bit i%8 of byte i/8 set when present */
+
+	/*
+	 * replication, also negotiated with Codecbatch.  Tfollow starts a
+	 * stream of Rfollow with the blocks of the datafile from addr on,
+	 * each with the address following it.  the follower sends Tack
+	 * with the address up to which it has stored the blocks.
+	 */
+	Tfollow		= 70,	/* addr[8] */
+	Rfollow,	/* addr[8] dheader[Diskdheadersize] data[size] */
+	Tack,		/* addr[8], not answered */
+	Codecbatch	= 0x6d,
+	Mreadsize	= Scoresize+1+1+2,
+	Mwritesize	= 1+1+2,	/* without data */
+	Mhavesize	= Scoresize+1+1,
+	Mhavemax	= (8+Datamax)/Mhavesize,
 };
 
 typedef struct Vmsg Vmsg;
@@ -71,12 +92,40 @@ struct Vmsg {
 	char *msg;
 	uchar *data;
 	ushort dsize;
+	uchar ext;	/* Thello and Rhello: batch extension */
+	ushort nbatch;	/* Tmread and Tmwrite */
+	uvlong addr;	/* Tfollow, Rfollow and Tack */
+};
+
+
+enum {
+	Connrbufsize	= 128*1024,	/* holds at least two messages */
+	Connwbufsize	= 16*1024,
+	Conniovmax	= 64,
+	Conncopymax	= 2*1024,	/* data copied into the reply buffer */
+	Replymax	= 2+2+2+Stringmax,	/* reply without data */
+	Followmsgmax	= 2+8+Diskdheadersize+Datamax,	/* Rfollow, larger than other messages */
+};
+
+typedef struct Conn Conn;
+
+struct Conn {
+	int fd;
+	uchar *rbuf;	/* received, rbuf[rp..rn) not yet parsed */
+	ulong rp, rn;
+	uchar *wbuf;	/* replies not yet written */
+	ulong wn;
+	struct iovec iov[Conniovmax];
+	int niov;
+	uchar *scratch;	/* reused after each reply */
+	ulong nscratch;
 };
 
 
 /* util.c */
 typedef struct Lock Lock;
 typedef struct RWLock RWLock;
+typedef struct Rendez Rendez;
 
 struct Lock {
 	pthread_mutex_t lock;
@@ -86,5 +135,276 @@ struct RWLock {
 	pthread_rwlock_t rwlock;
 };
 
+struct Rendez {
+	pthread_cond_t cond;
+	Lock *l;
+};
+
+typedef struct Pool Pool;
+
+struct Pool {
+	Lock lock;
+	char *name;
+	ulong size;
+	void (*release)(void *);	/* before an object is freed, may be nil */
+	void **free;	/* objects for reuse */
+	ulong nfree;
+	ulong maxfree;
+	ulong nused;
+	ulong nallocs;
+	ulong nreuses;
+};
+
 extern int debugflag;
 extern struct syslog_data sdata;
+
+
+/* util.c */
+enum {
+	Lockedhuge		= 1<<0,
+	Lockedinterleave	= 1<<1,
+	Hugepagesize		= 2*1024*1024,
+};
+
+typedef struct Lockedstats Lockedstats;
+
+struct Lockedstats {
+	uvlong huge;	/* bytes on explicit huge pages */
+	uvlong advised;	/* bytes advised for transparent huge pages */
+	uvlong plain;
+	uvlong interleaved;
+	ulong mlockfailed;
+	ulong hugefailed;
+	ulong interleavefailed;
+};
+
+extern int lockedflags;
+extern Lockedstats lockedstats;
+
+
+/* data.c */
+enum {
+	Segmax		= 64*1024,
+	Segshiftmin	= 20,
+	Alignshiftmax	= 12,	/* blocks are aligned to at most 4KB */
+	Devmax		= 16,
+	Streammax	= 256,
+	Mapshiftmax	= 30,	/* datafile is mapped in windows of at most 1GB */
+};
+
+typedef struct Dataseg Dataseg;
+typedef struct Datadev Datadev;
+typedef struct Datastream Datastream;
+typedef struct Data Data;
+
+struct Dataseg {
+	int fd;		/* -1 if missing */
+	uvlong size;
+	int dev;
+	int stream;	/* stream writing to it, -1 if none */
+	int sealed;
+	uchar **windows;	/* mapped windows, nil until first mapped */
+};
+
+struct Datadev {
+	char *file;
+	uvlong free;	/* bytes available on filesystem */
+};
+
+struct Datastream {
+	int dev;
+	int seg;	/* active segment, -1 if none yet */
+};
+
+struct Data {
+	int segshift;
+	int alignshift;	/* blocks start at multiples of 1<<alignshift */
+	int writable;
+	Lock lock;
+	Datadev devs[Devmax];
+	int ndevs;
+	Dataseg *segs;
+	int nsegs;
+	Datastream streams[Streammax];
+	int nstreams;
+	int mapped;	/* read through mmap */
+	int mapshift;	/* log2 of window size */
+	Lock maplock;
+};
+
+
+/* index.c */
+enum {
+	Nodemin		= 8,
+	Nodeclasses	= 13,	/* node capacities Nodemin<<0 to Nodemin<<12 */
+	Arenachunksize	= Hugepagesize,
+	Arenachunkunits	= Arenachunksize/8,
+	Arenamaxchunks	= (1ULL<<32)/Arenachunkunits,
+	Headlenmax	= 64,	/* mean entries per head above which the heads are doubled */
+	Headbitsmax	= 30,
+	Headsplitlen	= 4*Headlenmax,	/* heads longer than this get a subtable */
+	Subheadlen	= 16,	/* mean length of the lists of a subtable */
+	Subbitsmax	= 8,
+	Freezemin	= 64*1024,	/* new entries before the index is frozen again */
+	Filterbits	= 10,	/* minimum filter bits per frozen entry of a cold index */
+	Filterprobes	= 3,
+	Coldpagesize	= 4096,	/* cold records that fit are kept within a page */
+};
+
+typedef struct Farena Farena;
+typedef struct Index Index;
+typedef struct Lookup Lookup;
+
+/* arena for frozen records, a chunk is freed when none of its records are in use */
+struct Farena {
+	uchar **chunks;	/* nil for free chunk numbers */
+	ulong *slots;	/* chunk slot in the cold file, nil for memory */
+	ulong *live;	/* units of records in use, by chunk */
+	int nchunks;	/* chunk numbers handed out */
+	int *freechunks;	/* free chunk numbers below nchunks */
+	int nfreechunks;
+	int cur;	/* chunk being filled, -1 for none */
+	ulong chunkused;	/* units used in cur */
+	uvlong bytes;	/* in records */
+};
+
+/* a lookup of indexlookupbatch */
+struct Lookup {
+	uchar *score;
+	uchar type;
+	int n;	/* addresses found, -1 for more than fit */
+	uvlong *addrs;
+};
+
+struct Index {
+	int skipbits;	/* leading score bits selecting the index */
+	int headbits;
+	int entrybits;	/* score bits in the entries of heads */
+	int addrbits;
+	int fieldbits;	/* bits for the score part of an entry */
+	int entrysize;	/* bits per entry, excluding type */
+	uint32 *heads;	/* arena offset of first node, 0 for empty head */
+	ulong nheads;
+	uint32 *oheads;	/* heads of half the size while growing, nil otherwise */
+	ulong onheads;
+	ulong split;	/* oheads below split have been moved to heads */
+	ulong nentries;	/* at last compaction */
+	ulong ndynamic;	/* entries in nodes, at last compaction */
+
+	uint32 *frozen;	/* arena offset of frozen entries of heads, 0 for none */
+	uint32 *ofrozen;	/* of oheads while growing */
+	Farena far;
+	ulong nfrozen;
+	void *fents;	/* scratch for freezing */
+	ulong nfents;
+
+	int coldfd;	/* frozen records in file, -1 for memory */
+	ulong ncoldslots;
+	ulong *coldfree;	/* free chunk slots in the cold file */
+	int ncoldfree;
+	uint32 *filter;	/* arena offset of filter of frozen entries for a cold index */
+	uint32 *ofilter;
+	Farena filt;	/* in memory */
+	int alignshift;	/* addresses are kept shifted right by alignshift */
+	int lockbits;
+	RWLock locks[256];
+
+	Lock alloclock;
+	uchar **chunks;
+	int nchunks;
+	int maxchunks;
+	ulong chunkused;	/* arena units used in last chunk */
+	uint32 free[Nodeclasses+Subbitsmax];
+	uvlong nodebytes;
+	uvlong freebytes;
+	uvlong ncompacted;
+	uvlong nsplit;
+};
+
+
+/* meta.c */
+enum {
+	Shardmax	= 256,
+};
+
+typedef struct Meta Meta;
+
+struct Meta {
+	int present;	/* read from or written to file */
+	int nshards;
+	int alignshift;
+};
+
+
+/* scan.c */
+enum {
+	Scanchunksize	= 4*1024*1024,
+};
+
+typedef struct Scanblock Scanblock;
+typedef struct Scanchunk Scanchunk;
+typedef struct Scan Scan;
+
+struct Scanblock {
+	uvlong offset;
+	ulong len;	/* bytes in datafile, including header */
+	DHeader dh;
+	uchar *data;
+	char *err;	/* nil for valid blocks */
+};
+
+struct Scanchunk {
+	uchar *buf;
+	Scanblock *b;
+	int nb;
+	int nballoc;
+	int state;
+};
+
+struct Scan {
+	int fd;
+	uvlong start;
+	uvlong end;
+	uvlong base;	/* address of offset 0 in fd */
+	int nproc;
+	void (*fn)(Scan *, Scanblock *);
+	void (*prefetch)(Scan *, Scanblock *);	/* for a block passed to fn soon, may be nil */
+	void *aux;
+	char *err;
+
+	Lock lock;
+	Rendez rendez;
+	Scanchunk *chunks;
+	int nchunks;
+	uvlong nread;
+	uvlong nverify;
+	uvlong ndone;
+	int eof;
+	char errbuf[128];
+};
+
+
+/* recent.c */
+enum {
+	Recentways	= 4,	/* entries per set */
+	Recentlocks	= 64,
+};
+
+typedef struct Recentry Recentry;
+typedef struct Recent Recent;
+
+struct Recentry {
+	uchar score[Scoresize];
+	uchar type;
+	uchar used;
+	uvlong addr;
+};
+
+/* full scores of recently written and confirmed blocks */
+struct Recent {
+	Recentry *sets;	/* nsets*Recentways, most recently used first */
+	ulong nsets;
+	Lock locks[Recentlocks];
+	uvlong nhits;	/* atomic, counted under different set locks */
+	uvlong nmisses;	/* atomic */
+};
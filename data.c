@@ -0,0 +1,629 @@
+#include "memventi.h"
+
+/*
+ * the datafile, optionally split in segments of 1<<segshift bytes.
+ * segment n is stored in file "datafile.n".  an address is the number
+ * of the segment shifted left by segshift plus the offset in the segment,
+ * so index entries do not change.  segments are written to by streams,
+ * each stream appends to its own active segment, a block that does not
+ * fit in it starts a new segment.  full segments are sealed:  synced and
+ * made read-only.  sealed segments can be moved to other filesystems and
+ * replaced by a symlink.
+ * with multiple datafiles (devices), the segments are spread over the
+ * directories of the datafiles, each stream writes to one device.
+ * with segshift 0 there is only the single file "datafile".
+ * with alignshift > 0 each block is followed by zero bytes up to the
+ * next multiple of 1<<alignshift, so the index can store addresses
+ * shifted right by alignshift.
+ * the datafile can be read through windows of 1<<mapshift bytes mapped
+ * on first use.  bytes are never changed once written, and a window
+ * mapped past the end of a segment shows the bytes appended later.
+ */
+
+
+static void
+segname(Data *d, int dev, int n, char *buf, int len)
+{
+	if(d->segshift == 0)
+		snprintf(buf, len, "%s", d->devs[dev].file);
+	else
+		snprintf(buf, len, "%s.%d", d->devs[dev].file, n);
+}
+
+
+/* the directory of the datafile of dev in dir, returns the name of the datafile in it */
+static char *
+devdir(Data *d, int dev, char *dir, int len)
+{
+	char *p, *file;
+
+	file = d->devs[dev].file;
+	p = strrchr(file, '/');
+	if(p == nil) {
+		snprintf(dir, len, ".");
+		return file;
+	}
+	snprintf(dir, len, "%.*s", (int)MAX(1, p-file), file);
+	return p+1;
+}
+
+
+/* name of the file of segment n */
+void
+dataname(Data *d, int n, char *buf, int len)
+{
+	segname(d, d->segs[n].dev, n, buf, len);
+}
+
+
+static Dataseg *
+addrseg(Data *d, uvlong addr, uvlong *offp)
+{
+	int n;
+
+	if(d->segshift == 0) {
+		*offp = addr;
+		return &d->segs[0];
+	}
+	n = addr>>d->segshift;
+	if(n >= d->nsegs || d->segs[n].fd < 0)
+		return nil;
+	*offp = addr & ((1ULL<<d->segshift)-1);
+	return &d->segs[n];
+}
+
+
+static int
+segopen(Data *d, int dev, int n, int flags)
+{
+	char name[PATH_MAX];
+	Dataseg *s;
+
+	segname(d, dev, n, name, sizeof name);
+	s = &d->segs[n];
+	s->fd = open(name, flags, 0600);
+	if(s->fd < 0)
+		return 0;
+	s->size = filesize(s->fd);
+	s->dev = dev;
+	s->stream = -1;
+	s->windows = nil;
+	s->sealed = (flags & O_ACCMODE) == O_RDONLY;
+	return 1;
+}
+
+
+static void
+devfree(Data *d, int dev)
+{
+	struct statvfs st;
+	char dir[PATH_MAX];
+
+	devdir(d, dev, dir, sizeof dir);
+	if(statvfs(dir, &st) != 0)
+		return;
+	lock(&d->lock);
+	__atomic_store_n(&d->devs[dev].free, (uvlong)st.f_bavail*st.f_frsize, __ATOMIC_RELAXED);
+	unlock(&d->lock);
+}
+
+
+/*
+ * the size of a segment is changed under d->lock and published with a
+ * release store, readers that do not hold the lock load it with acquire
+ * so the bytes before it are written.
+ */
+static uvlong
+segsize(Dataseg *s)
+{
+	return __atomic_load_n(&s->size, __ATOMIC_ACQUIRE);
+}
+
+
+/* account for the bytes written to segment s up to offset end */
+static void
+segwritten(Data *d, Dataseg *s, uvlong end)
+{
+	Datadev *dev;
+
+	lock(&d->lock);
+	if(end > s->size) {
+		dev = &d->devs[s->dev];
+		__atomic_store_n(&dev->free, dev->free - MIN(dev->free, end-s->size), __ATOMIC_RELAXED);
+		__atomic_store_n(&s->size, end, __ATOMIC_RELEASE);
+	}
+	unlock(&d->lock);
+}
+
+
+/* bytes available on the device of stream, for picking a stream to write to */
+uvlong
+datafree(Data *d, int stream)
+{
+	return __atomic_load_n(&d->devs[d->streams[stream].dev].free, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * find the segments of device dev in the directory of its datafile.
+ * when rescanning, segments already open are skipped.
+ */
+static void
+devsegs(Data *d, int dev, int rescan)
+{
+	char dir[PATH_MAX];
+	char name[PATH_MAX];
+	char *base, *p, *e;
+	DIR *dirp;
+	struct dirent *de;
+	struct stat st;
+	long n;
+	int flags;
+
+	base = devdir(d, dev, dir, sizeof dir);
+	dirp = opendir(dir);
+	if(dirp == nil)
+		errsyslog(1, "opening directory %s for datafile %s", dir, d->devs[dev].file);
+	while((de = readdir(dirp)) != nil) {
+		if(strncmp(de->d_name, base, strlen(base)) != 0 || de->d_name[strlen(base)] != '.')
+			continue;
+		p = de->d_name+strlen(base)+1;
+		n = strtol(p, &e, 10);
+		if(*p < '0' || *p > '9' || *e != '\0')
+			continue;
+		if(n >= Segmax)
+			errxsyslog(1, "too many segments for datafile %s", d->devs[dev].file);
+		if(n < d->nsegs && d->segs[n].fd >= 0) {
+			if(rescan)
+				continue;
+			errxsyslog(1, "segment %ld of datafile present on multiple devices", n);
+		}
+		segname(d, dev, n, name, sizeof name);
+		if(stat(name, &st) != 0)
+			errsyslog(1, "stat datafile %s", name);
+		flags = O_RDONLY;
+		if(d->writable && (st.st_mode & S_IWUSR))
+			flags = O_RDWR|O_APPEND;
+		while(d->nsegs <= n)
+			d->segs[d->nsegs++].fd = -1;
+		if(!segopen(d, dev, n, flags))
+			errsyslog(1, "opening datafile %s", name);
+		if(d->segs[n].size > 1ULL<<d->segshift)
+			errxsyslog(1, "datafile %s larger than segment size %llu", name, 1ULL<<d->segshift);
+	}
+	closedir(dirp);
+}
+
+
+void
+dataopen(Data *d, char **files, int nfiles, int segshift, int writable)
+{
+	struct stat st;
+	int i;
+
+	if(nfiles > 1 && segshift == 0)
+		errxsyslog(1, "multiple datafiles require a segment size");
+	if(nfiles > Devmax)
+		errxsyslog(1, "too many datafiles");
+	if(!lockinit(&d->lock))
+		errxsyslog(1, "init data lock");
+	d->segshift = segshift;
+	d->alignshift = 0;
+	d->writable = writable;
+	d->ndevs = nfiles;
+	for(i = 0; i < nfiles; i++) {
+		d->devs[i].file = files[i];
+		d->devs[i].free = 0;
+	}
+	d->nsegs = 0;
+	d->segs = emalloc(sizeof d->segs[0] * (segshift == 0 ? 1 : Segmax));
+	d->nstreams = 0;
+	d->mapped = 0;
+	d->mapshift = 0;
+
+	if(segshift == 0) {
+		if(!segopen(d, 0, 0, writable ? O_RDWR|O_CREAT|O_APPEND : O_RDONLY))
+			errsyslog(1, "opening datafile %s", files[0]);
+		d->segs[0].sealed = 0;
+		d->nsegs = 1;
+		return;
+	}
+
+	for(i = 0; i < nfiles; i++) {
+		if(stat(files[i], &st) == 0)
+			errxsyslog(1, "datafile %s is not segmented", files[i]);
+		devsegs(d, i, 0);
+		devfree(d, i);
+	}
+	for(i = 0; i < d->nsegs; i++)
+		if(d->segs[i].fd < 0)
+			syslog_r(LOG_WARNING, &sdata, "segment %d of datafile missing", i);
+}
+
+
+/* bytes taken in the datafile by a block of n bytes including header */
+ulong
+dataslot(Data *d, ulong n)
+{
+	return roundup(n, 1<<d->alignshift);
+}
+
+
+/* pad the segment to the alignment, e.g. after truncation by memventi-check */
+static void
+segpad(Data *d, Dataseg *s)
+{
+	static uchar zeros[1<<Alignshiftmax];
+	ulong n;
+
+	n = dataslot(d, s->size) - s->size;
+	if(n == 0)
+		return;
+	if(pwriten(s->fd, zeros, n, s->size) != n)
+		errsyslog(1, "padding datafile to alignment");
+	s->size += n;
+}
+
+
+/*
+ * set up n streams for writing, stream i writes to device i%ndevs.
+ * segments that are not sealed are taken up by the streams of their
+ * device again, the remaining ones are sealed.
+ */
+void
+datastreams(Data *d, int n, int alignshift)
+{
+	Datastream *ds;
+	Dataseg *s;
+	int i, j;
+
+	if(n > Streammax)
+		errxsyslog(1, "too many streams");
+	d->alignshift = alignshift;
+	d->nstreams = n;
+	/* a read-only datafile is written by another process */
+	if(!d->writable)
+		return;
+	for(i = 0; i < n; i++) {
+		ds = &d->streams[i];
+		ds->dev = i % d->ndevs;
+		ds->seg = -1;
+		if(d->segshift == 0) {
+			ds->seg = 0;
+			d->segs[0].stream = i;
+			segpad(d, &d->segs[0]);
+			continue;
+		}
+		for(j = d->nsegs-1; j >= 0; j--) {
+			s = &d->segs[j];
+			if(s->fd >= 0 && !s->sealed && s->dev == ds->dev && s->stream < 0)
+				break;
+		}
+		if(j >= 0) {
+			ds->seg = j;
+			d->segs[j].stream = i;
+			segpad(d, &d->segs[j]);
+		}
+	}
+	for(j = 0; j < d->nsegs; j++) {
+		s = &d->segs[j];
+		if(s->fd >= 0 && !s->sealed && s->stream < 0) {
+			fsync(s->fd);
+			fchmod(s->fd, 0400);
+			s->sealed = 1;
+		}
+	}
+}
+
+
+/*
+ * for a datafile written by another process:  pick up the segments it
+ * started and the bytes it appended since the last time.
+ */
+void
+datarefresh(Data *d)
+{
+	int i;
+
+	lock(&d->lock);
+	if(d->segshift != 0)
+		for(i = 0; i < d->ndevs; i++)
+			devsegs(d, i, 1);
+	for(i = 0; i < d->nsegs; i++)
+		if(d->segs[i].fd >= 0)
+			__atomic_store_n(&d->segs[i].size, filesize(d->segs[i].fd), __ATOMIC_RELEASE);
+	unlock(&d->lock);
+}
+
+
+/* read through mmap from now on */
+void
+datamap(Data *d)
+{
+	d->mapshift = MIN(Mapshiftmax, d->segshift == 0 ? 48 : d->segshift);
+	if(!lockinit(&d->maplock))
+		errxsyslog(1, "init data map lock");
+	d->mapped = 1;
+}
+
+
+static uchar *
+mapwindow(Data *d, Dataseg *s, uvlong w)
+{
+	static int failed;
+	ulong nw;
+	uchar *p;
+
+	lock(&d->maplock);
+	if(s->windows == nil) {
+		nw = 1UL<<((d->segshift == 0 ? 48 : d->segshift) - d->mapshift);
+		s->windows = emalloc(nw * sizeof s->windows[0]);
+		memset(s->windows, 0, nw * sizeof s->windows[0]);
+	}
+	p = s->windows[w];
+	if(p == nil) {
+		p = mmap(nil, 1ULL<<d->mapshift, PROT_READ, MAP_SHARED, s->fd, (off_t)w<<d->mapshift);
+		if(p == MAP_FAILED) {
+			if(failed++ == 0)
+				syslog_r(LOG_WARNING, &sdata, "mmap of datafile: %s, reading instead", strerror(errno));
+			p = nil;
+		} else {
+			/* lookups are random, prefetching is done explicitly */
+			madvise(p, 1ULL<<d->mapshift, MADV_RANDOM);
+			s->windows[w] = p;
+		}
+	}
+	unlock(&d->maplock);
+	return p;
+}
+
+
+/*
+ * the n bytes at addr in the mapped datafile.  nil when not mapped,
+ * when the bytes are not in the datafile or when they span windows.
+ */
+uchar *
+datamapped(Data *d, uvlong addr, ulong n)
+{
+	Dataseg *s;
+	uvlong off, w;
+	uchar *p;
+
+	if(!d->mapped)
+		return nil;
+	s = addrseg(d, addr, &off);
+	if(s == nil || s->fd < 0 || n == 0 || off+n > segsize(s))
+		return nil;
+	w = off>>d->mapshift;
+	if((off+n-1)>>d->mapshift != w)
+		return nil;
+	p = nil;
+	if(s->windows != nil)
+		p = s->windows[w];
+	if(p == nil)
+		p = mapwindow(d, s, w);
+	if(p == nil)
+		return nil;
+	return p + (off & ((1ULL<<d->mapshift)-1));
+}
+
+
+/*
+ * start reading the n bytes at addr into memory, or those of them in
+ * the datafile and in the same mapped window.
+ */
+void
+dataprefetch(Data *d, uvlong addr, ulong n)
+{
+	Dataseg *s;
+	uvlong off, size;
+	uchar *p, *q;
+
+	s = addrseg(d, addr, &off);
+	if(s == nil || s->fd < 0 || n == 0)
+		return;
+	size = segsize(s);
+	if(off >= size)
+		return;
+	n = MIN(n, size-off);
+	if(!d->mapped) {
+#ifdef POSIX_FADV_WILLNEED
+		posix_fadvise(s->fd, off, n, POSIX_FADV_WILLNEED);
+#endif
+		return;
+	}
+	n = MIN(n, (1ULL<<d->mapshift) - (off & ((1ULL<<d->mapshift)-1)));
+	p = datamapped(d, addr, n);
+	if(p == nil)
+		return;
+	q = (uchar *)((uintptr_t)p & ~((uintptr_t)getpagesize()-1));
+	madvise(q, p+n-q, MADV_WILLNEED);
+}
+
+
+ssize_t
+dataread(Data *d, void *buf, size_t n, uvlong addr)
+{
+	Dataseg *s;
+	uvlong off;
+
+	s = addrseg(d, addr, &off);
+	if(s == nil)
+		return 0;
+	return preadn(s->fd, buf, n, off);
+}
+
+
+static Dataseg *
+writeseg(Data *d, uvlong addr, uvlong *offp)
+{
+	Dataseg *s;
+
+	s = addrseg(d, addr, offp);
+	if(s == nil || s->sealed) {
+		errno = EINVAL;
+		return nil;
+	}
+	return s;
+}
+
+
+/* write at addr, which must be at or before the end of the active segment of a stream */
+ssize_t
+datawrite(Data *d, void *buf, size_t n, uvlong addr)
+{
+	Dataseg *s;
+	uvlong off;
+	ssize_t r;
+
+	s = writeseg(d, addr, &off);
+	if(s == nil)
+		return -1;
+	r = pwriten(s->fd, buf, n, off);
+	if(r > 0)
+		segwritten(d, s, off+r);
+	return r;
+}
+
+
+ssize_t
+datawritev(Data *d, struct iovec *iov, int niov, uvlong addr)
+{
+	Dataseg *s;
+	uvlong off;
+	ssize_t r, have, want;
+	int i;
+
+	s = writeseg(d, addr, &off);
+	if(s == nil)
+		return -1;
+	want = 0;
+	for(i = 0; i < niov; i++)
+		want += iov[i].iov_len;
+	have = 0;
+	while(niov > 0) {
+		r = pwritev(s->fd, iov, MIN(niov, IOV_MAX), off+have);
+		if(r <= 0)
+			break;
+		have += r;
+		while(niov > 0 && r >= iov[0].iov_len) {
+			r -= iov[0].iov_len;
+			iov++;
+			niov--;
+		}
+		if(niov > 0) {
+			iov[0].iov_base = (char *)iov[0].iov_base + r;
+			iov[0].iov_len -= r;
+		}
+	}
+	if(have > 0)
+		segwritten(d, s, off+have);
+	if(have == 0 && want > 0)
+		return -1;
+	return have;
+}
+
+
+/* address at which n bytes would be appended by stream */
+uvlong
+dataappendaddr(Data *d, int stream, ulong n)
+{
+	Datastream *ds;
+	uvlong size;
+
+	ds = &d->streams[stream];
+	if(ds->seg >= 0) {
+		size = segsize(&d->segs[ds->seg]);
+		if(d->segshift == 0 || size+n <= 1ULL<<d->segshift)
+			return ((uvlong)ds->seg<<d->segshift) + size;
+	}
+	return (uvlong)d->nsegs<<d->segshift;
+}
+
+
+/* address for appending n bytes by stream, seals its segment and starts a new one if needed */
+uvlong
+dataalloc(Data *d, int stream, ulong n)
+{
+	char name[PATH_MAX];
+	Datastream *ds;
+	Dataseg *s;
+	uvlong addr;
+	int seg;
+
+	ds = &d->streams[stream];
+	if(ds->seg >= 0) {
+		addr = dataappendaddr(d, stream, n);
+		if(d->segshift == 0 || addr>>d->segshift == ds->seg)
+			return addr;
+	}
+
+	lock(&d->lock);
+	seg = d->nsegs;
+	if(seg == Segmax) {
+		unlock(&d->lock);
+		errno = ENOSPC;
+		return ~0ULL;
+	}
+	if(!segopen(d, ds->dev, seg, O_RDWR|O_CREAT|O_EXCL|O_APPEND)) {
+		unlock(&d->lock);
+		return ~0ULL;
+	}
+	d->segs[seg].stream = stream;
+	d->nsegs++;
+	unlock(&d->lock);
+
+	if(ds->seg >= 0) {
+		s = &d->segs[ds->seg];
+		if(fsync(s->fd) == 0)
+			fchmod(s->fd, 0400);
+		s->sealed = 1;
+		s->stream = -1;
+	}
+	ds->seg = seg;
+	devfree(d, ds->dev);
+	segname(d, ds->dev, seg, name, sizeof name);
+	syslog_r(LOG_NOTICE, &sdata, "datafile segment %s started", name);
+	return (uvlong)seg<<d->segshift;
+}
+
+
+int
+datasync(Data *d)
+{
+	int i, seg, ok;
+
+	ok = 1;
+	for(i = 0; i < d->nstreams; i++) {
+		seg = d->streams[i].seg;
+		if(seg >= 0 && fsync(d->segs[seg].fd) != 0)
+			ok = 0;
+	}
+	return ok;
+}
+
+
+/* parse a segment size, a power of two with optional suffix k, m, g or t */
+int
+parsesegsize(char *s)
+{
+	char *e;
+	uvlong v;
+	int shift;
+
+	v = strtoull(s, &e, 0);
+	switch(*e) {
+	case 't':	v <<= 10;
+	case 'g':	v <<= 10;
+	case 'm':	v <<= 10;
+	case 'k':	v <<= 10;
+		e++;
+	}
+	if(*e != '\0' || v == 0 || (v & (v-1)) != 0)
+		return -1;
+	for(shift = 0; (1ULL<<shift) != v; shift++)
+		;
+	if(shift < Segshiftmin || shift > 48)
+		return -1;
+	return shift;
+}
@@ -10,6 +10,7 @@
 #define GET64(p)        ((((uint64)GET32(p))<<32)+GET32((p)+4))
 #define PUT8(p, v)	((p)[0] = v)
 #define PUT16(p, v)     (((p)[0] = (uchar)((v)>>8)), ((p)[1] = (uchar)(v)))
+#define PUT24(p, v)     (PUT8((p), (uchar)((v)>>16)), PUT16((p)+1, (uint16)(v)))
 #define PUT32(p, v)     (PUT16((p), (uint16)((v)>>16)), PUT16((p)+2, (uint16)(v)))
 #define PUT48(p, v)     (PUT16((p), (uint16)((v)>>32)), PUT32((p)+2, (uint32)(v)))
 #define PUT64(p, v)     (PUT32((p), (uint32)((v)>>32)), PUT32((p)+4, (uint32)(v)))
@@ -26,6 +27,7 @@ void	putuvlong(uchar *, uvlong, uint, uint);
 /* util.c */
 void	sha1(uchar *, uchar *, uint);
 void	*lockedmalloc(ulong);
+void	lockedfree(void*, ulong);
 void	errsyslog(int, const char *, ...);
 void	errxsyslog(int, const char *, ...);
 void	debug(int, char *, ...);
@@ -37,7 +39,9 @@ void	*emalloc(ulong);
 void	*trymalloc(ulong);
 void	*erealloc(void *, ulong);
 ssize_t	preadn(int, void *, size_t, off_t);
+ssize_t	pwriten(int, void *, size_t, off_t);
 ssize_t	writen(int, char *, size_t);
+ssize_t	writevn(int, struct iovec *, int);
 uvlong	msec(void);
 int	lockinit(Lock *l);
 void	lock(Lock *l);
@@ -47,7 +51,70 @@ void	rlock(RWLock *l);
 void	wlock(RWLock *l);
 void	runlock(RWLock *l);
 void	wunlock(RWLock *l);
+int	rendezinit(Rendez *r, Lock *l);
+void	rsleep(Rendez *r);
+int	rsleepuntil(Rendez *r, uvlong);
+void	rwakeup(Rendez *r);
+void	rwakeupall(Rendez *r);
+void	poolinit(Pool *, char *, ulong, ulong, void (*)(void *));
+void	*poolget(Pool *);
+void	poolput(Pool *, void *);
+void	poolstats(Pool *);
 
 /* proto.c */
-int	readvmsg(FILE *, Vmsg *, uchar *);
-int	writevmsg(int, Vmsg *, uchar *);
+void	conninit(Conn *, int, uchar *, ulong);
+void	connfree(Conn *);
+int	connpending(Conn *);
+char	*connline(Conn *, char *, int);
+int	readvmsg(Conn *, Vmsg *);
+void	mreadentry(Vmsg *, int, Vmsg *);
+void	mhaveentry(Vmsg *, int, Vmsg *);
+uchar	*mwriteentry(uchar *, Vmsg *);
+int	connflush(Conn *);
+int	writevmsg(Conn *, Vmsg *);
+
+/* data.c */
+void	dataopen(Data *, char **, int, int, int);
+void	datastreams(Data *, int, int);
+void	datarefresh(Data *);
+uvlong	datafree(Data *, int);
+void	dataname(Data *, int, char *, int);
+ssize_t	dataread(Data *, void *, size_t, uvlong);
+void	datamap(Data *);
+uchar	*datamapped(Data *, uvlong, ulong);
+void	dataprefetch(Data *, uvlong, ulong);
+ssize_t	datawrite(Data *, void *, size_t, uvlong);
+ssize_t	datawritev(Data *, struct iovec *, int, uvlong);
+uvlong	dataappendaddr(Data *, int, ulong);
+uvlong	dataalloc(Data *, int, ulong);
+ulong	dataslot(Data *, ulong);
+int	datasync(Data *);
+int	parsesegsize(char *);
+
+/* index.c */
+void	indexinit(Index *, int, int, int, int, int);
+RWLock	*indexlockof(Index *, uchar *);
+int	indexlookup(Index *, uchar *, uchar, uvlong *, int);
+void	indexlookupbatch(Index *, Lookup *, int, int);
+void	indexprefetch(Index *, uchar *);
+int	indexinsert(Index *, uchar *, uchar, uvlong);
+ulong	indexnheads(Index *);
+ulong	indexheadlen(Index *, ulong);
+ulong	indexcompact(Index *);
+int	indexgrow(Index *);
+int	indexfreeze(Index *, ulong);
+void	indexcold(Index *, char *);
+
+/* meta.c */
+char	*metaread(char *, Meta *);
+char	*metawrite(char *, Meta *);
+char	*followread(char *, uvlong *);
+char	*followwrite(char *, uvlong);
+
+/* scan.c */
+int	scan(Scan *);
+
+/* recent.c */
+void	recentinit(Recent *, ulong);
+int	recentlookup(Recent *, uchar *, uchar, uvlong *);
+void	recentadd(Recent *, uchar *, uchar, uvlong);
@@ -0,0 +1,1634 @@
+#include "memventi.h"
+
+/*
+ * the in-memory index.  a score selects a head by the headbits bits
+ * after the skipbits bits that select the index (the shard).  a head is
+ * a list of nodes holding entries:  the type, the next entrybits bits
+ * of the score and the address of the block in the datafile, shifted
+ * right by alignshift.
+ *
+ * nodes live in an arena of large mlock-ed chunks and refer to each
+ * other by 32-bit offsets in units of 8 bytes, offset 0 is nil.  when
+ * the last node of a head is full, a node twice as large is appended.
+ * the compactor merges the nodes of a head into a single node and puts
+ * the old nodes on the free list for their size.
+ *
+ * a node starts with a header, followed by the types of the entries
+ * and the packed score bits and addresses.
+ *
+ * when the heads get too long on average, the number of heads is
+ * doubled while lookups continue:  one more score bit selects the head,
+ * one less is kept in the entries.  the heads of the old table are moved
+ * to the new table one at a time, heads below split have been moved.
+ * the score part of entries is kept in fieldbits bits, the width at
+ * init, so nodes of both tables have the same layout.
+ *
+ * a head that is much longer than the others is turned into a subtable:
+ * a node holding the offsets of 1<<subbits lists, selected by the
+ * leading bits of the score part of the entries.  this bounds the length
+ * of the lists to scan regardless of the number of heads.  the entries
+ * are not changed, subtables are undone when the heads are doubled.
+ *
+ * most entries are not in nodes but frozen in a compact form, see below.
+ */
+
+#ifdef __GNUC__
+#define prefetch(p)	__builtin_prefetch(p)
+#else
+#define prefetch(p)
+#endif
+
+enum {
+	Lookupgroup	= 16,	/* lookups interleaved by indexlookupbatch */
+};
+
+typedef struct Node Node;
+
+struct Node {
+	uint32 next;
+	uchar class;	/* capacity is Nodemin<<class, or a subtable */
+	uchar pad;
+	ushort n;
+};
+
+
+static Node *
+node(Index *ix, uint32 off)
+{
+	return (Node *)(ix->chunks[off/Arenachunkunits] + (off%Arenachunkunits)*8);
+}
+
+
+static ulong
+nodecap(int class)
+{
+	return Nodemin<<class;
+}
+
+
+/* subtables have classes from Nodeclasses, for 1 to Subbitsmax bits */
+static int
+issub(Node *nd)
+{
+	return nd->class >= Nodeclasses;
+}
+
+
+static int
+subbits(Node *nd)
+{
+	return nd->class-Nodeclasses+1;
+}
+
+
+static uint32 *
+subheads(Node *nd)
+{
+	return (uint32 *)&nd[1];
+}
+
+
+/* size of a node of class in arena units */
+static ulong
+nodeunits(Index *ix, int class)
+{
+	ulong cap;
+
+	if(class >= Nodeclasses)
+		return (sizeof (Node) + (sizeof (uint32)<<(class-Nodeclasses+1)) + 7)/8;
+	cap = nodecap(class);
+	return (sizeof (Node) + cap + roundup(cap*ix->entrysize, 8)/8 + 7)/8;
+}
+
+
+static uchar *
+nodetypes(Node *nd)
+{
+	return (uchar *)&nd[1];
+}
+
+
+static uvlong
+entrybit(Index *ix, Node *nd, int i)
+{
+	return 8*nodecap(nd->class) + (uvlong)ix->entrysize*i;
+}
+
+
+static void
+putentry(Index *ix, Node *nd, int i, uvlong e, uchar type, uvlong addr)
+{
+	uvlong bit;
+
+	nodetypes(nd)[i] = type;
+	bit = entrybit(ix, nd, i);
+	putuvlong(nodetypes(nd), e, bit, ix->fieldbits);
+	putuvlong(nodetypes(nd), addr, bit+ix->fieldbits, ix->addrbits);
+}
+
+
+static uvlong
+getentry(Index *ix, Node *nd, int i, uvlong *addrp)
+{
+	uvlong bit;
+
+	bit = entrybit(ix, nd, i);
+	if(addrp != nil)
+		*addrp = getuvlong(nodetypes(nd), bit+ix->fieldbits, ix->addrbits);
+	return getuvlong(nodetypes(nd), bit, ix->fieldbits);
+}
+
+
+static void
+copyentry(Index *ix, Node *dst, int j, Node *src, int i)
+{
+	uvlong e, addr;
+
+	e = getentry(ix, src, i, &addr);
+	putentry(ix, dst, j, e, nodetypes(src)[i], addr);
+}
+
+
+/* allocate a node from the free list or the arena, callers hold ix->alloclock */
+static uint32
+nodealloc(Index *ix, int class)
+{
+	uint32 off;
+	ulong units;
+	uchar *p;
+	Node *nd;
+
+	off = ix->free[class];
+	units = nodeunits(ix, class);
+	if(off != 0) {
+		ix->free[class] = node(ix, off)->next;
+		ix->freebytes -= units*8;
+	} else {
+		if(ix->nchunks == 0 || ix->chunkused+units > Arenachunkunits) {
+			if(ix->nchunks == ix->maxchunks)
+				return 0;
+			p = lockedmalloc(Arenachunksize);
+			if(p == nil)
+				return 0;
+			ix->chunks[ix->nchunks++] = p;
+			/* offset 0 is nil */
+			ix->chunkused = ix->nchunks == 1 ? 1 : 0;
+		}
+		off = (ix->nchunks-1)*Arenachunkunits + ix->chunkused;
+		ix->chunkused += units;
+	}
+	ix->nodebytes += units*8;
+	nd = node(ix, off);
+	nd->next = 0;
+	nd->class = class;
+	nd->n = 0;
+	return off;
+}
+
+
+static void
+nodefree(Index *ix, uint32 off)
+{
+	Node *nd;
+	ulong units;
+
+	nd = node(ix, off);
+	units = nodeunits(ix, nd->class);
+	nd->next = ix->free[nd->class];
+	ix->free[nd->class] = off;
+	ix->nodebytes -= units*8;
+	ix->freebytes += units*8;
+}
+
+
+/* callers hold ix->alloclock */
+static void
+freenodes(Index *ix, uint32 off)
+{
+	uint32 next;
+
+	for(; off != 0; off = next) {
+		next = node(ix, off)->next;
+		nodefree(ix, off);
+	}
+}
+
+
+/* the lists of entries of the head at headp, returns their number */
+static ulong
+headlists(Index *ix, uint32 *headp, uint32 **listsp)
+{
+	Node *nd;
+
+	if(*headp != 0) {
+		nd = node(ix, *headp);
+		if(issub(nd)) {
+			*listsp = subheads(nd);
+			return 1UL<<subbits(nd);
+		}
+	}
+	*listsp = headp;
+	return 1;
+}
+
+
+/* free the nodes of a head, callers hold ix->alloclock */
+static void
+freehead(Index *ix, uint32 off)
+{
+	uint32 *lists;
+	ulong i, nlists;
+
+	nlists = headlists(ix, &off, &lists);
+	for(i = 0; i < nlists; i++)
+		freenodes(ix, lists[i]);
+	if(lists != &off)
+		nodefree(ix, off);
+}
+
+
+/*
+ * allocate as few nodes as possible for n entries, callers hold
+ * ix->alloclock.  returns 0 when out of memory.
+ */
+static int
+allocnodes(Index *ix, ulong n, uint32 *firstp)
+{
+	uint32 off;
+	uint32 *offp;
+	ulong left;
+	int class;
+
+	*firstp = 0;
+	offp = firstp;
+	for(left = n; left > 0; left -= MIN(left, nodecap(class))) {
+		for(class = 0; class < Nodeclasses-1 && nodecap(class) < left; class++)
+			;
+		off = nodealloc(ix, class);
+		if(off == 0) {
+			freenodes(ix, *firstp);
+			*firstp = 0;
+			return 0;
+		}
+		*offp = off;
+		offp = &node(ix, off)->next;
+	}
+	return 1;
+}
+
+
+/* zeroed array of offsets for n heads, nil when out of memory */
+static uint32 *
+headarray(ulong n)
+{
+	uint32 *a;
+	ulong i;
+
+	a = lockedmalloc(n * sizeof a[0]);
+	if(a == nil)
+		return nil;
+	for(i = 0; i < n; i++)
+		a[i] = 0;
+	return a;
+}
+
+
+static void
+freeheadarray(uint32 *a, ulong n)
+{
+	if(a != nil)
+		lockedfree(a, n * sizeof a[0]);
+}
+
+
+static void
+farenainit(Index *ix, Farena *a)
+{
+	a->chunks = emalloc(ix->maxchunks * sizeof a->chunks[0]);
+	a->slots = nil;
+	a->live = emalloc(ix->maxchunks * sizeof a->live[0]);
+	a->nchunks = 0;
+	a->freechunks = emalloc(ix->maxchunks * sizeof a->freechunks[0]);
+	a->nfreechunks = 0;
+	a->cur = -1;
+	a->chunkused = 0;
+	a->bytes = 0;
+}
+
+
+void
+indexinit(Index *ix, int skipbits, int headbits, int entrybits, int addrbits, int alignshift)
+{
+	ulong i;
+
+	ix->skipbits = skipbits;
+	ix->headbits = headbits;
+	ix->entrybits = entrybits;
+	ix->addrbits = addrbits;
+	ix->fieldbits = entrybits;
+	ix->entrysize = entrybits+addrbits;
+	ix->alignshift = alignshift;
+	ix->nheads = 1UL<<headbits;
+	ix->heads = headarray(ix->nheads);
+	if(ix->heads == nil)
+		errsyslog(1, "malloc for heads, %lu bytes", ix->nheads * sizeof ix->heads[0]);
+	ix->oheads = nil;
+	ix->onheads = 0;
+	ix->split = 0;
+	ix->nentries = 0;
+	ix->ndynamic = 0;
+	ix->lockbits = MIN(8, headbits);
+
+	ix->frozen = headarray(ix->nheads);
+	if(ix->frozen == nil)
+		errsyslog(1, "malloc for frozen heads, %lu bytes", ix->nheads * sizeof ix->frozen[0]);
+	ix->ofrozen = nil;
+	ix->nfrozen = 0;
+	ix->fents = nil;
+	ix->nfents = 0;
+
+	ix->maxchunks = Arenamaxchunks;
+	ix->chunks = emalloc(ix->maxchunks * sizeof ix->chunks[0]);
+	ix->nchunks = 0;
+	ix->chunkused = 0;
+	farenainit(ix, &ix->far);
+	farenainit(ix, &ix->filt);
+	ix->coldfd = -1;
+	ix->ncoldslots = 0;
+	ix->coldfree = nil;
+	ix->ncoldfree = 0;
+	ix->filter = nil;
+	ix->ofilter = nil;
+	for(i = 0; i < nelem(ix->free); i++)
+		ix->free[i] = 0;
+	ix->nodebytes = 0;
+	ix->freebytes = 0;
+	ix->ncompacted = 0;
+	ix->nsplit = 0;
+
+	if(!lockinit(&ix->alloclock))
+		errxsyslog(1, "init index alloc lock");
+	for(i = 0; i < nelem(ix->locks); i++)
+		if(!rwlockinit(&ix->locks[i]))
+			errxsyslog(1, "init hash table lock");
+}
+
+
+/*
+ * keep the frozen records in file instead of memory, with a filter of
+ * the frozen entries of each head in memory.  the file is rewritten
+ * from the index at every start.
+ */
+void
+indexcold(Index *ix, char *file)
+{
+	ix->coldfd = open(file, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if(ix->coldfd < 0)
+		errsyslog(1, "opening cold index file %s", file);
+	ix->coldfree = emalloc(ix->maxchunks * sizeof ix->coldfree[0]);
+	ix->far.slots = emalloc(ix->maxchunks * sizeof ix->far.slots[0]);
+	ix->filter = headarray(ix->nheads);
+	if(ix->filter == nil)
+		errsyslog(1, "malloc for filters of heads, %lu bytes", ix->nheads * sizeof ix->filter[0]);
+}
+
+
+/* the list of the head at headp for the score part e of ebits bits */
+static uint32 *
+listfor(Index *ix, uint32 *headp, uvlong e, int ebits)
+{
+	Node *nd;
+
+	if(*headp != 0) {
+		nd = node(ix, *headp);
+		if(issub(nd))
+			return &subheads(nd)[e >> (ebits-subbits(nd))];
+	}
+	return headp;
+}
+
+
+/*
+ * the locks are selected by the leading lockbits bits of the score, so
+ * a head and the heads it is split into are covered by the same lock.
+ */
+static RWLock *
+headlock(Index *ix, ulong h, int headbits)
+{
+	return &ix->locks[h >> (headbits - ix->lockbits)];
+}
+
+
+RWLock *
+indexlockof(Index *ix, uchar *score)
+{
+	return &ix->locks[getuvlong(score, ix->skipbits, ix->lockbits)];
+}
+
+
+static void
+wlockall(Index *ix)
+{
+	int i;
+
+	for(i = 0; i < nelem(ix->locks); i++)
+		wlock(&ix->locks[i]);
+}
+
+
+static void
+wunlockall(Index *ix)
+{
+	int i;
+
+	for(i = 0; i < nelem(ix->locks); i++)
+		wunlock(&ix->locks[i]);
+}
+
+
+static ulong
+listlen(Index *ix, uint32 off)
+{
+	ulong n;
+
+	n = 0;
+	for(; off != 0; off = node(ix, off)->next)
+		n += node(ix, off)->n;
+	return n;
+}
+
+
+static ulong
+headlen(Index *ix, uint32 *headp)
+{
+	uint32 *lists;
+	ulong i, nlists, n;
+
+	n = 0;
+	nlists = headlists(ix, headp, &lists);
+	for(i = 0; i < nlists; i++)
+		n += listlen(ix, lists[i]);
+	return n;
+}
+
+
+/*
+ * frozen heads.  the entries of a head sorted on their score part are
+ * stored in a record in a frozen arena:  a header with the number of
+ * entries and the rice parameter k, the types, the packed addresses and
+ * the differences between successive score parts, rice coded:  the
+ * difference shifted right by k in unary (zeros ended by a one) followed
+ * by its low k bits.  this takes about k+2 bits per entry for the score
+ * part, with k about entrybits minus log2 of the head length.
+ *
+ * a freeze rewrites only the heads with entries in nodes, and the
+ * heads whose record is in a chunk that is mostly unused, to new
+ * records, one head at a time.  the other heads keep their records.
+ * the record header holds the size of the record, so the old record is
+ * freed right away; a chunk is freed when none of its records are in
+ * use.  new entries go to the nodes of a head until the next freeze.
+ * growing the heads writes new records for the moved heads.
+ *
+ * for a cold index the frozen arena is chunks of a file, mapped shared,
+ * and a second arena in memory holds a bloom filter of the frozen
+ * entries of each head.  lookups only touch the record when the filter
+ * matches, and records that fit are kept within a page.
+ */
+
+typedef struct Frozen Frozen;
+typedef struct Filter Filter;
+typedef struct Fentry Fentry;
+typedef struct Fiter Fiter;
+
+struct Frozen {
+	uint32 n;
+	uchar k;
+	uchar units[3];	/* size of the record */
+};
+
+/* followed by 1<<bits bits */
+struct Filter {
+	uint32 n;
+	uchar bits;
+	uchar pad[3];
+};
+
+struct Fentry {
+	uvlong e;
+	uvlong addr;
+	uchar type;
+};
+
+struct Fiter {
+	Frozen *fr;
+	ulong i;	/* entries decoded */
+	uvlong e;
+	uvlong bit;	/* of the next code */
+};
+
+
+static void *
+arecord(Farena *a, uint32 off)
+{
+	if(off == 0)
+		return nil;
+	return a->chunks[off/Arenachunkunits] + (off%Arenachunkunits)*8;
+}
+
+
+static uchar *
+ftypes(Frozen *fr)
+{
+	return (uchar *)&fr[1];
+}
+
+
+/* the addresses followed by the codes */
+static uchar *
+fbits(Frozen *fr)
+{
+	return ftypes(fr)+fr->n;
+}
+
+
+static uvlong
+faddr(Index *ix, Frozen *fr, ulong i)
+{
+	return getuvlong(fbits(fr), i*ix->addrbits, ix->addrbits);
+}
+
+
+static ulong
+frozenlen(Frozen *fr)
+{
+	return fr != nil ? fr->n : 0;
+}
+
+
+/* the frozen record of head h of the old table while growing, or of the current table */
+static Frozen *
+frozenhead(Index *ix, int old, ulong h)
+{
+	return arecord(&ix->far, old ? ix->ofrozen[h] : ix->frozen[h]);
+}
+
+
+static Filter *
+filterhead(Index *ix, int old, ulong h)
+{
+	return arecord(&ix->filt, old ? ix->ofilter[h] : ix->filter[h]);
+}
+
+
+static ulong
+filterunits(int bits)
+{
+	return (sizeof (Filter) + (1UL<<bits)/8 + 7)/8;
+}
+
+
+/* the filter bits to test for score part e and type */
+static void
+filterprobes(Filter *fl, uvlong e, uchar type, uvlong *probes)
+{
+	uvlong x, h1, h2;
+	int i;
+
+	x = (e ^ ((uvlong)type<<56)) * 0x9e3779b97f4a7c15ULL;
+	x ^= x>>29;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	h1 = x>>32;
+	h2 = (x & 0xffffffff) | 1;
+	for(i = 0; i < Filterprobes; i++)
+		probes[i] = (h1 + i*h2) & ((1ULL<<fl->bits)-1);
+}
+
+
+static int
+filtered(Filter *fl, uvlong e, uchar type)
+{
+	uvlong probes[Filterprobes];
+	uchar *p;
+	int i;
+
+	filterprobes(fl, e, type, probes);
+	p = (uchar *)&fl[1];
+	for(i = 0; i < Filterprobes; i++)
+		if((p[probes[i]>>3] & (1<<(probes[i]&7))) == 0)
+			return 0;
+	return 1;
+}
+
+
+/*
+ * the frozen record of a head that may hold score part e with type.  a
+ * cold record is only touched when the filter in memory allows e.
+ */
+static Frozen *
+frozenfor(Index *ix, int old, ulong h, uvlong e, uchar type)
+{
+	Filter *fl;
+
+	if(ix->coldfd >= 0) {
+		fl = filterhead(ix, old, h);
+		if(fl == nil || !filtered(fl, e, type))
+			return nil;
+	}
+	return frozenhead(ix, old, h);
+}
+
+
+/* number of frozen entries of a head, without touching cold records */
+static ulong
+frozencount(Index *ix, int old, ulong h)
+{
+	Filter *fl;
+
+	if(ix->coldfd >= 0) {
+		fl = filterhead(ix, old, h);
+		return fl != nil ? fl->n : 0;
+	}
+	return frozenlen(frozenhead(ix, old, h));
+}
+
+
+static void
+fiterinit(Index *ix, Fiter *it, Frozen *fr)
+{
+	it->fr = fr;
+	it->i = 0;
+	it->e = 0;
+	it->bit = (uvlong)fr->n*ix->addrbits;
+}
+
+
+/* decode the next score part into it->e, returns 0 at the end */
+static int
+fnext(Fiter *it)
+{
+	uchar *p;
+	uvlong q;
+
+	if(it->i == it->fr->n)
+		return 0;
+	p = fbits(it->fr);
+	q = 0;
+	while(((p[it->bit>>3] >> (7-(it->bit&7))) & 1) == 0) {
+		q++;
+		it->bit++;
+	}
+	it->bit++;
+	it->e += (q<<it->fr->k) | getuvlong(p, it->bit, it->fr->k);
+	it->bit += it->fr->k;
+	it->i++;
+	return 1;
+}
+
+
+static int
+frozenlookup(Index *ix, Frozen *fr, uvlong e, uchar type, uvlong *addrs, int n, int naddrs)
+{
+	Fiter it;
+
+	if(fr == nil)
+		return n;
+	fiterinit(ix, &it, fr);
+	while(fnext(&it) && it.e <= e) {
+		if(it.e != e || ftypes(fr)[it.i-1] != type)
+			continue;
+		if(n >= naddrs)
+			return -1;
+		addrs[n++] = faddr(ix, fr, it.i-1)<<ix->alignshift;
+	}
+	return n;
+}
+
+
+/*
+ * map a chunk slot of the cold file.  the file is extended by writing
+ * zeros, not by ftruncate:  a full disk must fail here and not on a store
+ * to the mapping.
+ */
+static uchar *
+coldchunk(Index *ix, ulong *slotp)
+{
+	static uchar zeros[Coldpagesize];
+	ulong slot, off;
+	uchar *p;
+
+	if(ix->ncoldfree > 0)
+		slot = ix->coldfree[--ix->ncoldfree];
+	else {
+		slot = ix->ncoldslots;
+		for(off = 0; off < Arenachunksize; off += sizeof zeros)
+			if(pwriten(ix->coldfd, zeros, sizeof zeros, (off_t)slot*Arenachunksize+off) != sizeof zeros) {
+				syslog_r(LOG_WARNING, &sdata, "extending cold index file: %s", strerror(errno));
+				return nil;
+			}
+		ix->ncoldslots++;
+	}
+	p = mmap(nil, Arenachunksize, PROT_READ|PROT_WRITE, MAP_SHARED, ix->coldfd, (off_t)slot*Arenachunksize);
+	if(p == MAP_FAILED) {
+		syslog_r(LOG_WARNING, &sdata, "mmap of cold index file: %s", strerror(errno));
+		ix->coldfree[ix->ncoldfree++] = slot;
+		return nil;
+	}
+	/* lookups read a single record, readahead only pollutes the page cache */
+	madvise(p, Arenachunksize, MADV_RANDOM);
+	*slotp = slot;
+	return p;
+}
+
+
+static void
+chunkfree(Index *ix, Farena *a, int c)
+{
+	if(a->slots != nil) {
+		munmap(a->chunks[c], Arenachunksize);
+		ix->coldfree[ix->ncoldfree++] = a->slots[c];
+	} else
+		lockedfree(a->chunks[c], Arenachunksize);
+	a->chunks[c] = nil;
+	a->freechunks[a->nfreechunks++] = c;
+}
+
+
+static uint32
+farenaalloc(Index *ix, Farena *a, ulong units)
+{
+	uint32 off;
+	ulong page;
+	uchar *p;
+	int c;
+
+	/* keep cold records that fit within a page, so a lookup reads one page */
+	page = Coldpagesize/8;
+	if(a->slots != nil && a->cur >= 0 && units <= page && a->chunkused%page + units > page)
+		a->chunkused = roundup(a->chunkused, page);
+	if(a->cur < 0 || a->chunkused+units > Arenachunkunits) {
+		if(a->nfreechunks > 0)
+			c = a->freechunks[a->nfreechunks-1];
+		else if(a->nchunks < ix->maxchunks)
+			c = a->nchunks;
+		else
+			return 0;
+		if(a->slots != nil)
+			p = coldchunk(ix, &a->slots[c]);
+		else
+			p = lockedmalloc(Arenachunksize);
+		if(p == nil)
+			return 0;
+		if(c == a->nchunks)
+			a->nchunks++;
+		else
+			a->nfreechunks--;
+		/* the chunk that was filled is freed with its last record */
+		if(a->cur >= 0 && a->live[a->cur] == 0)
+			chunkfree(ix, a, a->cur);
+		a->chunks[c] = p;
+		a->live[c] = 0;
+		a->cur = c;
+		/* offset 0 is nil */
+		a->chunkused = c == 0 ? 1 : 0;
+		if(a->slots != nil && units <= page && a->chunkused+units > page)
+			a->chunkused = page;
+	}
+	off = a->cur*Arenachunkunits + a->chunkused;
+	a->chunkused += units;
+	a->live[a->cur] += units;
+	a->bytes += units*8;
+	return off;
+}
+
+
+/* free the record of units at off, and its chunk when it was the last in use */
+static void
+farenarelease(Index *ix, Farena *a, uint32 off, ulong units)
+{
+	int c;
+
+	c = off/Arenachunkunits;
+	a->live[c] -= units;
+	a->bytes -= units*8;
+	if(a->live[c] == 0 && c != a->cur)
+		chunkfree(ix, a, c);
+}
+
+
+/* whether the record at off is in a chunk that is mostly unused, and not being filled */
+static int
+farenasparse(Farena *a, uint32 off)
+{
+	int c;
+
+	if(off == 0)
+		return 0;
+	c = off/Arenachunkunits;
+	return c != a->cur && a->live[c] < Arenachunkunits/4;
+}
+
+
+/* free a frozen record and a filter, either may be 0 */
+static void
+freefrozen(Index *ix, uint32 frozen, uint32 filter)
+{
+	Frozen *fr;
+	Filter *fl;
+
+	if(frozen != 0) {
+		fr = arecord(&ix->far, frozen);
+		ix->nfrozen -= fr->n;
+		farenarelease(ix, &ix->far, frozen, GET24(fr->units));
+	}
+	if(filter != 0) {
+		fl = arecord(&ix->filt, filter);
+		farenarelease(ix, &ix->filt, filter, filterunits(fl->bits));
+	}
+}
+
+
+/* collect the entries in the nodes at headp and in frozen record fr in ix->fents */
+static ulong
+gather(Index *ix, uint32 *headp, Frozen *fr)
+{
+	Fentry *fe;
+	uint32 *lists;
+	ulong i, k, n, nlists;
+	uint32 off;
+	Node *nd;
+	Fiter it;
+	int j;
+
+	n = headlen(ix, headp) + frozenlen(fr);
+	if(n > ix->nfents) {
+		ix->nfents = MAX(n, 2*ix->nfents);
+		ix->fents = erealloc(ix->fents, ix->nfents * sizeof fe[0]);
+	}
+	fe = ix->fents;
+	i = 0;
+	nlists = headlists(ix, headp, &lists);
+	for(k = 0; k < nlists; k++)
+		for(off = lists[k]; off != 0; off = nd->next) {
+			nd = node(ix, off);
+			for(j = 0; j < nd->n; j++, i++) {
+				fe[i].e = getentry(ix, nd, j, &fe[i].addr);
+				fe[i].type = nodetypes(nd)[j];
+			}
+		}
+	if(fr != nil) {
+		fiterinit(ix, &it, fr);
+		for(; fnext(&it); i++) {
+			fe[i].e = it.e;
+			fe[i].type = ftypes(fr)[it.i-1];
+			fe[i].addr = faddr(ix, fr, it.i-1);
+		}
+	}
+	return n;
+}
+
+
+static int
+fentrycmp(const void *a, const void *b)
+{
+	const Fentry *x, *y;
+
+	x = a;
+	y = b;
+	if(x->e != y->e)
+		return x->e < y->e ? -1 : 1;
+	return 0;
+}
+
+
+/* make the filter for n sorted entries, returns 0 when out of memory */
+static uint32
+storefilter(Index *ix, Fentry *fe, ulong n)
+{
+	uvlong probes[Filterprobes];
+	Filter *fl;
+	uint32 off;
+	uchar *p;
+	ulong i;
+	int b, j;
+
+	for(b = 6; (1ULL<<b) < (uvlong)Filterbits*n; b++)
+		;
+	off = farenaalloc(ix, &ix->filt, filterunits(b));
+	if(off == 0)
+		return 0;
+	fl = arecord(&ix->filt, off);
+	fl->n = n;
+	fl->bits = b;
+	p = (uchar *)&fl[1];
+	for(i = 0; i < n; i++) {
+		filterprobes(fl, fe[i].e, fe[i].type, probes);
+		for(j = 0; j < Filterprobes; j++)
+			p[probes[j]>>3] |= 1<<(probes[j]&7);
+	}
+	return off;
+}
+
+
+/*
+ * store n entries with score parts of ebits bits in a new frozen
+ * record, its offset is put in *frozenp, and for a cold
+ * index the offset of its filter in *filterp.  entries too many for a
+ * record in a chunk are put in nodes at *headp instead.  returns 0 when
+ * out of memory.
+ */
+static int
+storeentries(Index *ix, Fentry *fe, ulong n, int ebits, uint32 *frozenp, uint32 *filterp, uint32 *headp)
+{
+	Frozen *fr;
+	uvlong bits, bit, prev, d, q, m;
+	ulong i, units;
+	uint32 off;
+	Node *nd;
+	int k, ok;
+
+	*frozenp = 0;
+	*filterp = 0;
+	*headp = 0;
+	if(n == 0)
+		return 1;
+	qsort(fe, n, sizeof fe[0], fentrycmp);
+	for(k = 0; k < ebits && ((1ULL<<ebits) >> (k+1)) >= n; k++)
+		;
+	bits = (uvlong)n*ix->addrbits;
+	prev = 0;
+	for(i = 0; i < n; i++) {
+		bits += ((fe[i].e-prev)>>k) + 1 + k;
+		prev = fe[i].e;
+	}
+	units = (sizeof (Frozen) + n + (bits+7)/8 + 7)/8;
+
+	if(units < Arenachunkunits) {
+		if(ix->coldfd >= 0) {
+			*filterp = storefilter(ix, fe, n);
+			if(*filterp == 0)
+				return 0;
+		}
+		off = farenaalloc(ix, &ix->far, units);
+		if(off == 0) {
+			freefrozen(ix, 0, *filterp);
+			*filterp = 0;
+			return 0;
+		}
+		fr = arecord(&ix->far, off);
+		fr->n = n;
+		fr->k = k;
+		PUT24(fr->units, units);
+		for(i = 0; i < n; i++) {
+			ftypes(fr)[i] = fe[i].type;
+			putuvlong(fbits(fr), fe[i].addr, i*ix->addrbits, ix->addrbits);
+		}
+		bit = (uvlong)n*ix->addrbits;
+		prev = 0;
+		for(i = 0; i < n; i++) {
+			d = fe[i].e-prev;
+			prev = fe[i].e;
+			for(q = d>>k; q > 0; q -= m) {
+				m = MIN(q, 32);
+				putuvlong(fbits(fr), 0, bit, m);
+				bit += m;
+			}
+			putuvlong(fbits(fr), 1, bit++, 1);
+			putuvlong(fbits(fr), d & ((1ULL<<k)-1), bit, k);
+			bit += k;
+		}
+		*frozenp = off;
+		ix->nfrozen += n;
+		return 1;
+	}
+
+	lock(&ix->alloclock);
+	ok = allocnodes(ix, n, headp);
+	unlock(&ix->alloclock);
+	if(!ok)
+		return 0;
+	nd = node(ix, *headp);
+	for(i = 0; i < n; i++) {
+		if(nd->n == nodecap(nd->class))
+			nd = node(ix, nd->next);
+		putentry(ix, nd, nd->n++, fe[i].e, fe[i].type, fe[i].addr);
+	}
+	return 1;
+}
+
+
+/* whether a freeze rewrites head h:  it has entries in nodes, or its record or filter is in a mostly unused chunk */
+static int
+headdirty(Index *ix, ulong h)
+{
+	if(ix->heads[h] != 0)
+		return 1;
+	if(farenasparse(&ix->far, ix->frozen[h]))
+		return 1;
+	return ix->filter != nil && farenasparse(&ix->filt, ix->filter[h]);
+}
+
+
+/* freeze head h, callers hold its lock for writing.  returns 0 when out of memory. */
+static int
+freezehead(Index *ix, ulong h)
+{
+	uint32 frozen, filter, head, off, ofrozen, ofilter;
+	ulong n;
+
+	n = gather(ix, &ix->heads[h], frozenhead(ix, 0, h));
+	if(!storeentries(ix, ix->fents, n, ix->entrybits, &frozen, &filter, &head))
+		return 0;
+	off = ix->heads[h];
+	ofrozen = ix->frozen[h];
+	ofilter = ix->filter != nil ? ix->filter[h] : 0;
+	ix->heads[h] = head;
+	ix->frozen[h] = frozen;
+	if(ix->filter != nil)
+		ix->filter[h] = filter;
+	freefrozen(ix, ofrozen, ofilter);
+	lock(&ix->alloclock);
+	freehead(ix, off);
+	unlock(&ix->alloclock);
+	return 1;
+}
+
+
+/*
+ * freeze the dirty heads when ndynamic entries were added to nodes
+ * since the last freeze.  a freeze that ran out of memory is continued
+ * by the next, the heads frozen already are clean.  returns whether the
+ * index was frozen.
+ */
+int
+indexfreeze(Index *ix, ulong ndynamic)
+{
+	RWLock *l;
+	ulong h;
+	int ok;
+
+	if(ix->oheads != nil)
+		return 0;
+	if(ndynamic < MAX(Freezemin, ix->nfrozen/4))
+		return 0;
+	for(h = 0; h < ix->nheads; h++) {
+		l = headlock(ix, h, ix->headbits);
+		wlock(l);
+		ok = !headdirty(ix, h) || freezehead(ix, h);
+		wunlock(l);
+		if(!ok)
+			return 0;
+	}
+	ix->ndynamic = 0;
+	return 1;
+}
+
+
+/*
+ * the list for score and the score part of its entries, and in *frp if
+ * frp is not nil the frozen record that may hold it with type.  callers
+ * hold the lock for score.
+ */
+static uint32 *
+listof(Index *ix, uchar *score, uchar type, uvlong *ep, Frozen **frp)
+{
+	ulong h;
+
+	if(ix->oheads != nil) {
+		h = getuvlong(score, ix->skipbits, ix->headbits-1);
+		if(h >= ix->split) {
+			*ep = getuvlong(score, ix->skipbits+ix->headbits-1, ix->entrybits+1);
+			if(frp != nil)
+				*frp = frozenfor(ix, 1, h, *ep, type);
+			return listfor(ix, &ix->oheads[h], *ep, ix->entrybits+1);
+		}
+	}
+	h = getuvlong(score, ix->skipbits, ix->headbits);
+	*ep = getuvlong(score, ix->skipbits+ix->headbits, ix->entrybits);
+	if(frp != nil)
+		*frp = frozenfor(ix, 0, h, *ep, type);
+	return listfor(ix, &ix->heads[h], *ep, ix->entrybits);
+}
+
+
+static int
+listlookup(Index *ix, uint32 off, uvlong e, uchar type, Frozen *fr, uvlong *addrs, int naddrs)
+{
+	uvlong addr;
+	Node *nd;
+	uchar *types;
+	int i, n;
+
+	n = 0;
+	for(; off != 0; off = nd->next) {
+		nd = node(ix, off);
+		types = nodetypes(nd);
+		for(i = 0; i < nd->n; i++) {
+			if(types[i] != type || getentry(ix, nd, i, &addr) != e)
+				continue;
+			if(n >= naddrs)
+				return -1;
+			addrs[n++] = addr<<ix->alignshift;
+		}
+	}
+	return frozenlookup(ix, fr, e, type, addrs, n, naddrs);
+}
+
+
+/* callers hold the lock for score */
+int
+indexlookup(Index *ix, uchar *score, uchar type, uvlong *addrs, int naddrs)
+{
+	uvlong e;
+	uint32 *listp;
+	Frozen *fr;
+
+	listp = listof(ix, score, type, &e, &fr);
+	return listlookup(ix, *listp, e, type, fr, addrs, naddrs);
+}
+
+
+/* head h of the old or current table for score, like listof */
+static void
+headof(Index *ix, uchar *score, int *oldp, ulong *hp)
+{
+	if(ix->oheads != nil) {
+		*hp = getuvlong(score, ix->skipbits, ix->headbits-1);
+		*oldp = *hp >= ix->split;
+		if(*oldp)
+			return;
+	}
+	*oldp = 0;
+	*hp = getuvlong(score, ix->skipbits, ix->headbits);
+}
+
+
+/* the head and the offset of its frozen record or filter */
+static uint32 *
+headslots(Index *ix, int old, ulong h, uint32 **frozenp)
+{
+	if(ix->coldfd >= 0)
+		*frozenp = old ? &ix->ofilter[h] : &ix->filter[h];
+	else
+		*frozenp = old ? &ix->ofrozen[h] : &ix->frozen[h];
+	return old ? &ix->oheads[h] : &ix->heads[h];
+}
+
+
+/* start loading the head of score into the cache, for a lookup soon after */
+void
+indexprefetch(Index *ix, uchar *score)
+{
+	uint32 *frozenp;
+	ulong h;
+	int old;
+
+	headof(ix, score, &old, &h);
+	prefetch(headslots(ix, old, h, &frozenp));
+	prefetch(frozenp);
+}
+
+
+/*
+ * lookups of n scores, each with room for naddrs addresses.  every
+ * lookup is a chain of dependent cache misses:  head, subtable, node,
+ * frozen record.  the lookups of a group are done a step at a time,
+ * each step prefetching for all of them what the next step reads, so
+ * the misses of a group overlap.  callers hold the locks for all
+ * scores.
+ */
+void
+indexlookupbatch(Index *ix, Lookup *l, int n, int naddrs)
+{
+	uint32 *headp[Lookupgroup], *listp[Lookupgroup], *frozenp;
+	uvlong e[Lookupgroup];
+	Frozen *fr[Lookupgroup];
+	ulong h[Lookupgroup];
+	int old[Lookupgroup];
+	int i, j, m;
+
+	for(i = 0; i < n; i += m) {
+		m = MIN(Lookupgroup, n-i);
+		for(j = 0; j < m; j++) {
+			headof(ix, l[i+j].score, &old[j], &h[j]);
+			headp[j] = headslots(ix, old[j], h[j], &frozenp);
+			prefetch(headp[j]);
+			prefetch(frozenp);
+		}
+		for(j = 0; j < m; j++) {
+			if(*headp[j] != 0)
+				prefetch(node(ix, *headp[j]));
+			if(ix->coldfd >= 0)
+				prefetch(filterhead(ix, old[j], h[j]));
+			else
+				prefetch(frozenhead(ix, old[j], h[j]));
+		}
+		for(j = 0; j < m; j++) {
+			listp[j] = listof(ix, l[i+j].score, l[i+j].type, &e[j], &fr[j]);
+			if(*listp[j] != 0)
+				prefetch(node(ix, *listp[j]));
+			if(fr[j] != nil)
+				prefetch(fr[j]);
+		}
+		for(j = 0; j < m; j++)
+			l[i+j].n = listlookup(ix, *listp[j], e[j], l[i+j].type, fr[j], l[i+j].addrs, naddrs);
+	}
+}
+
+
+/* callers hold the lock for score for writing, returns 0 when out of memory */
+int
+indexinsert(Index *ix, uchar *score, uchar type, uvlong addr)
+{
+	uint32 *offp;
+	uint32 off;
+	uvlong e;
+	Node *nd;
+	int class;
+
+	offp = listof(ix, score, type, &e, nil);
+	nd = nil;
+	while(*offp != 0) {
+		nd = node(ix, *offp);
+		offp = &nd->next;
+	}
+	if(nd == nil || nd->n == nodecap(nd->class)) {
+		class = nd == nil ? 0 : MIN(nd->class+1, Nodeclasses-1);
+		lock(&ix->alloclock);
+		off = nodealloc(ix, class);
+		unlock(&ix->alloclock);
+		if(off == 0)
+			return 0;
+		nd = node(ix, off);
+		putentry(ix, nd, nd->n++, e, type, addr>>ix->alignshift);
+		*offp = off;
+		return 1;
+	}
+	putentry(ix, nd, nd->n++, e, type, addr>>ix->alignshift);
+	return 1;
+}
+
+
+/* number of heads, while growing the moved heads of both tables count once */
+ulong
+indexnheads(Index *ix)
+{
+	if(ix->oheads != nil)
+		return 2*ix->split + ix->onheads-ix->split;
+	return ix->nheads;
+}
+
+
+/* callers hold all locks, h is below indexnheads */
+ulong
+indexheadlen(Index *ix, ulong h)
+{
+	if(ix->oheads != nil && h >= 2*ix->split)
+		return headlen(ix, &ix->oheads[h-ix->split]) + frozencount(ix, 1, h-ix->split);
+	return headlen(ix, &ix->heads[h]) + frozencount(ix, 0, h);
+}
+
+
+/*
+ * merge the nodes of the list at listp into as few nodes as possible,
+ * callers hold its lock for writing.  returns 0 when out of memory.
+ */
+static int
+compactlist(Index *ix, uint32 *listp)
+{
+	uint32 off, first;
+	Node *nd, *dst;
+	int i, ok;
+
+	lock(&ix->alloclock);
+	ok = allocnodes(ix, listlen(ix, *listp), &first);
+	unlock(&ix->alloclock);
+	if(!ok)
+		return 0;
+
+	dst = node(ix, first);
+	for(off = *listp; off != 0; off = nd->next) {
+		nd = node(ix, off);
+		for(i = 0; i < nd->n; i++) {
+			if(dst->n == nodecap(dst->class))
+				dst = node(ix, dst->next);
+			copyentry(ix, dst, dst->n++, nd, i);
+		}
+	}
+
+	off = *listp;
+	*listp = first;
+	lock(&ix->alloclock);
+	freenodes(ix, off);
+	unlock(&ix->alloclock);
+	return 1;
+}
+
+
+/* whether the list has more nodes than needed for its entries */
+static int
+listneedscompact(Index *ix, uint32 off)
+{
+	ulong n, nnodes, max;
+
+	n = nnodes = 0;
+	for(; off != 0; off = node(ix, off)->next) {
+		n += node(ix, off)->n;
+		nnodes++;
+	}
+	max = nodecap(Nodeclasses-1);
+	return nnodes > 1 && nnodes > (n+max-1)/max;
+}
+
+
+/* subtable bits for a head of n entries, 0 for none */
+static int
+wantsubbits(Index *ix, ulong n)
+{
+	int bits;
+
+	if(n <= Headsplitlen || ix->entrybits < 2)
+		return 0;
+	for(bits = 1; bits < Subbitsmax && bits < ix->entrybits-1 && (n>>bits) > Subheadlen; bits++)
+		;
+	return bits;
+}
+
+
+static int
+cursubbits(Index *ix, uint32 *headp)
+{
+	if(*headp == 0 || !issub(node(ix, *headp)))
+		return 0;
+	return subbits(node(ix, *headp));
+}
+
+
+/*
+ * turn head h into a subtable of 1<<bits lists, or a subtable into a
+ * larger one.  callers hold the lock for h for writing.  returns 0 when
+ * out of memory.
+ */
+static int
+splithead(Index *ix, ulong h, int bits)
+{
+	ulong n[1<<Subbitsmax];
+	Node *dst[1<<Subbitsmax];
+	uint32 *lists, *subs;
+	ulong i, k, nlists, nsubs;
+	uint32 off, sub;
+	Node *nd;
+	int j;
+
+	nsubs = 1UL<<bits;
+	for(k = 0; k < nsubs; k++)
+		n[k] = 0;
+	nlists = headlists(ix, &ix->heads[h], &lists);
+	for(i = 0; i < nlists; i++)
+		for(off = lists[i]; off != 0; off = nd->next) {
+			nd = node(ix, off);
+			for(j = 0; j < nd->n; j++)
+				n[getentry(ix, nd, j, nil) >> (ix->entrybits-bits)]++;
+		}
+
+	lock(&ix->alloclock);
+	sub = nodealloc(ix, Nodeclasses+bits-1);
+	if(sub == 0) {
+		unlock(&ix->alloclock);
+		return 0;
+	}
+	subs = subheads(node(ix, sub));
+	for(k = 0; k < nsubs; k++) {
+		if(!allocnodes(ix, n[k], &subs[k])) {
+			while(k-- > 0)
+				freenodes(ix, subs[k]);
+			nodefree(ix, sub);
+			unlock(&ix->alloclock);
+			return 0;
+		}
+	}
+	unlock(&ix->alloclock);
+
+	for(k = 0; k < nsubs; k++)
+		dst[k] = subs[k] != 0 ? node(ix, subs[k]) : nil;
+	for(i = 0; i < nlists; i++)
+		for(off = lists[i]; off != 0; off = nd->next) {
+			nd = node(ix, off);
+			for(j = 0; j < nd->n; j++) {
+				k = getentry(ix, nd, j, nil) >> (ix->entrybits-bits);
+				if(dst[k]->n == nodecap(dst[k]->class))
+					dst[k] = node(ix, dst[k]->next);
+				copyentry(ix, dst[k], dst[k]->n++, nd, j);
+			}
+		}
+
+	off = ix->heads[h];
+	ix->heads[h] = sub;
+	lock(&ix->alloclock);
+	freehead(ix, off);
+	ix->nsplit++;
+	unlock(&ix->alloclock);
+	return 1;
+}
+
+
+/*
+ * whether head h has lists with more nodes than needed for their entries
+ * or is long enough for a (larger) subtable, sets *np to its length.
+ */
+static int
+needscompact(Index *ix, ulong h, ulong *np)
+{
+	uint32 *lists;
+	ulong i, nlists;
+	int need;
+
+	need = 0;
+	nlists = headlists(ix, &ix->heads[h], &lists);
+	for(i = 0; i < nlists && !need; i++)
+		need = listneedscompact(ix, lists[i]);
+	*np = headlen(ix, &ix->heads[h]);
+	return need || wantsubbits(ix, *np) > cursubbits(ix, &ix->heads[h]);
+}
+
+
+/* callers hold the lock for h for writing, returns 0 when out of memory */
+static int
+compacthead(Index *ix, ulong h, ulong n)
+{
+	uint32 *lists;
+	ulong i, nlists;
+	int bits;
+
+	bits = wantsubbits(ix, n);
+	if(bits > cursubbits(ix, &ix->heads[h]))
+		return splithead(ix, h, bits);
+
+	nlists = headlists(ix, &ix->heads[h], &lists);
+	for(i = 0; i < nlists; i++)
+		if(listneedscompact(ix, lists[i]) && !compactlist(ix, &lists[i]))
+			return 0;
+	lock(&ix->alloclock);
+	ix->ncompacted++;
+	unlock(&ix->alloclock);
+	return 1;
+}
+
+
+/*
+ * compact all heads consisting of multiple nodes, one head at a time
+ * so lookups are held up only briefly.  counts the entries in nodes.
+ * returns the number of heads compacted.
+ */
+ulong
+indexcompact(Index *ix)
+{
+	RWLock *l;
+	ulong h, n, len, nentries;
+	int need;
+
+	n = 0;
+	nentries = 0;
+	for(h = 0; h < ix->nheads; h++) {
+		l = headlock(ix, h, ix->headbits);
+		rlock(l);
+		need = needscompact(ix, h, &len);
+		runlock(l);
+		nentries += len;
+		if(!need)
+			continue;
+		wlock(l);
+		if(needscompact(ix, h, &len) && compacthead(ix, h, len))
+			n++;
+		wunlock(l);
+	}
+	if(ix->oheads == nil) {
+		ix->ndynamic = nentries;
+		ix->nentries = nentries + ix->nfrozen;
+	}
+	return n;
+}
+
+
+/*
+ * move old head oh to the two heads it is split into, the leading bit
+ * of the score part of its entries selects the new head.  the entries
+ * of the new heads are frozen, a subtable is undone.  callers hold the
+ * lock for oh for writing.  returns 0 when out of memory.
+ */
+static int
+movehead(Index *ix, ulong oh)
+{
+	uint32 frozen[2], filter[2], head[2];
+	Fentry *fe;
+	Fentry t;
+	ulong i, n, n0;
+	uint32 off;
+
+	n = gather(ix, &ix->oheads[oh], frozenhead(ix, 1, oh));
+	fe = ix->fents;
+	n0 = 0;
+	for(i = 0; i < n; i++)
+		if((fe[i].e>>ix->entrybits) == 0) {
+			t = fe[n0];
+			fe[n0++] = fe[i];
+			fe[i] = t;
+		}
+	for(i = 0; i < n; i++)
+		fe[i].e &= (1ULL<<ix->entrybits)-1;
+
+	if(!storeentries(ix, fe, n0, ix->entrybits, &frozen[0], &filter[0], &head[0]))
+		return 0;
+	if(!storeentries(ix, fe+n0, n-n0, ix->entrybits, &frozen[1], &filter[1], &head[1])) {
+		freefrozen(ix, frozen[0], filter[0]);
+		lock(&ix->alloclock);
+		freenodes(ix, head[0]);
+		unlock(&ix->alloclock);
+		return 0;
+	}
+
+	ix->heads[2*oh] = head[0];
+	ix->heads[2*oh+1] = head[1];
+	ix->frozen[2*oh] = frozen[0];
+	ix->frozen[2*oh+1] = frozen[1];
+	freefrozen(ix, ix->ofrozen[oh], ix->ofilter != nil ? ix->ofilter[oh] : 0);
+	if(ix->filter != nil) {
+		ix->filter[2*oh] = filter[0];
+		ix->filter[2*oh+1] = filter[1];
+		ix->ofilter[oh] = 0;
+	}
+	off = ix->oheads[oh];
+	ix->oheads[oh] = 0;
+	ix->ofrozen[oh] = 0;
+	ix->split = oh+1;
+	lock(&ix->alloclock);
+	freehead(ix, off);
+	unlock(&ix->alloclock);
+	return 1;
+}
+
+
+/*
+ * double the number of heads when they are too long on average, as
+ * determined by the last compaction, or continue an earlier doubling
+ * that ran out of memory.  the old heads are split one at a time.
+ * returns whether the number of heads was doubled.
+ */
+int
+indexgrow(Index *ix)
+{
+	uint32 *heads, *frozen, *filter;
+	RWLock *l;
+	ulong h;
+	int ok;
+
+	if(ix->oheads == nil) {
+		if(ix->nentries <= Headlenmax*ix->nheads || ix->entrybits <= 1 || ix->headbits >= Headbitsmax)
+			return 0;
+		heads = headarray(2*ix->nheads);
+		frozen = headarray(2*ix->nheads);
+		filter = ix->filter != nil ? headarray(2*ix->nheads) : nil;
+		if(heads == nil || frozen == nil || (ix->filter != nil && filter == nil)) {
+			syslog_r(LOG_WARNING, &sdata, "malloc for growing heads, %lu bytes", 2*ix->nheads * sizeof heads[0]);
+			freeheadarray(heads, 2*ix->nheads);
+			freeheadarray(frozen, 2*ix->nheads);
+			freeheadarray(filter, 2*ix->nheads);
+			return 0;
+		}
+		wlockall(ix);
+		ix->oheads = ix->heads;
+		ix->ofrozen = ix->frozen;
+		ix->ofilter = ix->filter;
+		ix->onheads = ix->nheads;
+		ix->split = 0;
+		ix->heads = heads;
+		ix->frozen = frozen;
+		ix->filter = filter;
+		ix->nheads *= 2;
+		ix->headbits++;
+		ix->entrybits--;
+		wunlockall(ix);
+	}
+
+	for(h = ix->split; h < ix->onheads; h++) {
+		l = headlock(ix, h, ix->headbits-1);
+		wlock(l);
+		ok = movehead(ix, h);
+		wunlock(l);
+		if(!ok)
+			return 0;
+	}
+
+	wlockall(ix);
+	heads = ix->oheads;
+	frozen = ix->ofrozen;
+	filter = ix->ofilter;
+	ix->oheads = nil;
+	ix->ofrozen = nil;
+	ix->ofilter = nil;
+	ix->ndynamic = 0;
+	wunlockall(ix);
+	freeheadarray(heads, ix->onheads);
+	freeheadarray(frozen, ix->onheads);
+	freeheadarray(filter, ix->onheads);
+	return 1;
+}
@@ -2,13 +2,33 @@
 
 
 typedef struct Args Args;
-typedef struct Chain Chain;
+typedef struct Flight Flight;
+typedef struct Follower Follower;
+typedef struct Importbuf Importbuf;
 typedef struct Netaddr Netaddr;
+typedef struct Shard Shard;
+typedef struct Wreq Wreq;
+typedef struct Writer Writer;
 
 enum {
 	Listenmax	= 32,
+	Socketmax	= 256,	/* listening sockets, and acceptors */
+	Backlogdefault	= 128,
 	Addressesmax	= 16,
 	Stacksize	= 32*1024,
+	Compactinterval	= 10,
+	Importmax	= 16,
+	Importbatch	= 8*1024*1024,
+	Writebatchmax	= 64,
+	Recentdefault	= 64*1024,
+	Connbufsize	= Diskdheadersize+Datamax,	/* messages, and blocks read with their header */
+	Lookupbatch	= 32,
+	Connpoolmax	= 64,
+	Datapoolmax	= 64,
+	Flightpoolmax	= 64,
+	Followretry	= 5,	/* seconds between connection attempts to the primary */
+	Tailinterval	= 1,	/* seconds between checks for growth of the datafile */
+	Acktimeout	= 5000,	/* milliseconds a write waits for a live follower with -y */
 };
 
 enum {
@@ -22,103 +42,190 @@ struct Args {
 	int fd;
 	int allowwrite;
 	uchar *buf;
+	Conn conn;
 };
 
-struct Chain {
-	Chain *next;
-	uchar *data;
-	uchar n;
-} __attribute__((__packed__));
-
 struct Netaddr {
 	char *host;
 	char *port;
+	char *path;	/* unix socket, host and port unused */
+	int mode;	/* of path, -1 to leave as created */
+};
+
+/*
+ * a shard owns the scores starting with its number, in shardbits bits.
+ * it has its own index in memory, locks, indexfile and (with multiple
+ * shards) its own writer and datafile stream.
+ */
+struct Shard {
+	int id;
+	Index index;
+	char *indexfile;
+	int indexfd;
+	uvlong indexfilesize;
+	Lock indexlock;
+	uvlong nblocks;
+	uchar *importibuf;
+	ulong importilen;
+	ulong importdynamic;	/* entries imported in nodes since the last freeze */
+	pthread_t compactthread;
+	Recent recent;
+	Lock flightlock;
+	Rendez flightdone;
+	Flight *flights;	/* requests in progress */
+	Pool flightpool;
+};
+
+struct Flight {
+	uchar op;
+	uchar score[Scoresize];
+	uchar type;
+	ushort count;
+	int nref;	/* first request and those waiting for it */
+	int done;
+	uchar rop;	/* result */
+	char *msg;
+	uchar *data;
+	ushort dsize;
+	Flight *next;
+};
+
+struct Wreq {
+	Shard *shard;
+	DHeader *dh;
+	uchar *data;
+	uvlong addr;	/* set by writer, ~0ULL on error */
+	char *err;
+	int done;
+	Wreq *next;
+};
+
+struct Writer {
+	int stream;
+	Lock lock;
+	Rendez work;
+	Rendez done;
+	Wreq *first, *last;
+	int nqueued;
+	pthread_t thread;
+};
+
+/* a follower connected to this memventi */
+struct Follower {
+	Conn *c;
+	uchar tag;
+	uchar *buf;
+	uvlong pos;	/* of next block to send */
+	uvlong caught;	/* pos when replproc was last at the end of the datafile */
+	uvlong acked;	/* blocks before it are stored by the follower */
+	int atend;	/* replproc has been at the end of the datafile */
+	int live;	/* acked up to caught, and not timed out since */
+	int done;
+	Follower *next;
+};
+
+/* imported blocks pending for a stream */
+struct Importbuf {
+	uchar *buf;
+	uvlong addr;
+	ulong len;
 };
 
 struct syslog_data sdata = SYSLOG_DATA_INIT;
 
 static int fflag;
 static int vflag;
+static int mflag;
+static int tflag;	/* datafile is written by another process */
 
-static int datafd;
-static int indexfd;
-static uvlong datafilesize;
-static uvlong indexfilesize;
+static Data disk;
+static Pool connpool;	/* Args of connections, with their buffers */
+static Pool datapool;	/* block data for coalesced requests */
 
-static char *datafile = "data";
+static char *datafiles[Devmax];
+static int ndatafiles;
+static char *datafile;
 static char *indexfile = "index";
-
-static Chain *heads;
-static ulong nheads;
-static uchar *mem;
-static uchar *memend;
-static uvlong nblocks;
+static char *coldfile;
+static char metafile[PATH_MAX];
+static int segshift;
+static int nshardsflag;
+static int alignshift;
+static int alignflag = -1;
+static ulong nrecent = Recentdefault;
+
+static Shard *shards;
+static int nshards;
+static int shardbits;
 
 static int headscorewidth;
 static int entryscorewidth;
 static int addrwidth;
 static uvlong endaddr;
-static int mementrysize;
-static uint initheadlen;
 
 static char *defaultport= "17034";
 
-static RWLock htlock[256];
-static Lock disklock;
+static Writer writers[Devmax];
+static int nwriters;
 static Lock statelock;
 static int state;
 
-static pthread_t readlistenthread[Listenmax];
-static pthread_t writelistenthread[Listenmax];
+static pthread_t listenthreads[Socketmax];
+static int nlistenthreads;
 static pthread_t syncprocthread;
 static int nreadaddrs, nwriteaddrs;
 static int nreadlistens, nwritelistens;
+static int backlog = Backlogdefault;
+static int nacceptors = 1;
+static int nodelay;
+static int sockbufsize;
+
+static Lock repllock;
+static Rendez replmore;	/* replend advanced, or a follower is done */
+static Rendez replacked;
+static uvlong replend;	/* blocks before it are written */
+static Follower *followers;
+static int yflag;	/* writes wait for the live followers */
+
+static Netaddr primary;
+static int following;
+static char followfile[PATH_MAX];
+static Lock followlock;
+static uvlong followpos;
+
+static uvlong *tailpos;	/* per segment, blocks before it are in the index */
 
 static uvlong nlookups;
-static uvlong diskhisto[Addressesmax];
+static uvlong nshared;
+static uvlong diskhisto[Addressesmax+1];	/* by number of candidates, 0 to Addressesmax */
+
+static char *importfiles[Importmax];
+static int nimportfiles;
+static int importnproc;
+static Importbuf importbufs[Streammax];
+static uvlong nimported, nimportdup, nimportbad;
 
 
+static char Ewrite[] = "error writing block";
+static char Efull[] = "data file is full";
+
 static uchar zeroscore[Scoresize] = {
 	0xda, 0x39, 0xa3, 0xee, 0x5e, 0x6b, 0x4b, 0xd, 0x32, 0x55,
 	0xbf, 0xef, 0x95, 0x60, 0x18, 0x90, 0xaf, 0xd8, 0x7, 0x9
 };
 
 
-static uvlong
-getaddr(Chain *c, int i)
-{
-	return getuvlong(c->data, 8*c->n+(entryscorewidth+addrwidth)*i+entryscorewidth, addrwidth);
-}
-
-
-static int
-isscore(uchar *score, Chain *c, int i)
-{
-	uvlong n1, n2;
-
-	n1 = getuvlong(score, headscorewidth, entryscorewidth);
-	n2 = getuvlong(c->data, c->n*8+(entryscorewidth+addrwidth)*i, entryscorewidth);
-	return n1 == n2;
-}
-
-
-static int
-istype(uchar type, Chain *c, int i)
-{
-	return c->data[i] == type;
-}
-
-
-static int
-isend(Chain *c, int i)
+static Shard *
+shardof(uchar *score)
 {
-	return getaddr(c, i) == endaddr;
+	return &shards[getuvlong(score, 0, shardbits)];
 }
 
 
 static void
 disklookuphisto(void)
 {
+	uvlong hits, misses;
 	int i;
 
 	printf("disk lookup histogram:\n");
@@ -128,27 +235,17 @@ disklookuphisto(void)
 			printf("%7d  %llu\n", i, diskhisto[i]);
 	}
 	printf("total memory lookups: %llu\n", nlookups);
-}
-
-
-static ulong
-headcount(Chain *c)
-{
-	ulong n;
-	int i;
-	uchar *p;
-
-	n = 0;
-	for(; c->next != nil; c = c->next)
-		n += c->n;
-
-	p = c->data;
-	for(i = 0; i < c->n; i++)
-		if(isend(c, i))
-			break;
-		else
-			n++;
-	return n;
+	printf("requests sharing the result of a concurrent request: %llu\n", nshared);
+	hits = misses = 0;
+	for(i = 0; i < nshards; i++) {
+		hits += __atomic_load_n(&shards[i].recent.nhits, __ATOMIC_RELAXED);
+		misses += __atomic_load_n(&shards[i].recent.nmisses, __ATOMIC_RELAXED);
+	}
+	printf("recent scores: %llu writes found, %llu not found\n", hits, misses);
+	poolstats(&connpool);
+	poolstats(&datapool);
+	for(i = 0; i < nshards; i++)
+		poolstats(&shards[i].flightpool);
 }
 
 
@@ -159,24 +256,41 @@ headhisto(void)
 	ulong i, j;
 	ulong lastindex;
 	ulong index;
+	uvlong nblocks, nodebytes, freebytes, ncompacted, nsplit, nfrozen, frozenbytes, filterbytes;
+	Index *ix;
+	int k;
 
 	freqs = emalloc(sizeof freqs[0]);
 	lastindex = 0;
 	freqs[0] = 0;
-	for(i = 0; i < nelem(htlock); i++)
-		rlock(&htlock[i]);
-	for(i = 0; i < nheads; i++) {
-		index = headcount(&heads[i]);
-		if(index > lastindex)
-			freqs = erealloc(freqs, sizeof freqs[0] * (index+1));
-		for(j = lastindex+1; j <= index; j++)
-			freqs[j] = 0;
-		freqs[index] += 1;
-		if(index > lastindex)
-			lastindex = index;
-	}
-	for(i = 0; i < nelem(htlock); i++)
-		runlock(&htlock[i]);
+	nblocks = nodebytes = freebytes = ncompacted = nsplit = nfrozen = frozenbytes = filterbytes = 0;
+	for(k = 0; k < nshards; k++) {
+		ix = &shards[k].index;
+		for(i = 0; i < nelem(ix->locks); i++)
+			rlock(&ix->locks[i]);
+		for(i = 0; i < indexnheads(ix); i++) {
+			index = indexheadlen(ix, i);
+			if(index > lastindex)
+				freqs = erealloc(freqs, sizeof freqs[0] * (index+1));
+			for(j = lastindex+1; j <= index; j++)
+				freqs[j] = 0;
+			freqs[index] += 1;
+			if(index > lastindex)
+				lastindex = index;
+		}
+		lock(&ix->alloclock);
+		nodebytes += ix->nodebytes;
+		freebytes += ix->freebytes;
+		ncompacted += ix->ncompacted;
+		nsplit += ix->nsplit;
+		unlock(&ix->alloclock);
+		nfrozen += ix->nfrozen;
+		frozenbytes += ix->far.bytes;
+		filterbytes += ix->filt.bytes;
+		for(i = 0; i < nelem(ix->locks); i++)
+			runlock(&ix->locks[i]);
+		nblocks += shards[k].nblocks;
+	}
 
 	printf("head length histogram:\n");
 	printf("count    frequency\n");
@@ -185,161 +299,95 @@ headhisto(void)
 			printf("%7lu  %10lu\n", i, freqs[i]);
 	}
 	printf("nblocks: %llu\n", nblocks);
+	printf("index: %llu bytes in nodes, %llu bytes free, %llu heads compacted, %llu heads split\n",
+		nodebytes, freebytes, ncompacted, nsplit);
+	printf("frozen: %llu entries in %llu bytes in %s, %llu bytes of filters\n",
+		nfrozen, frozenbytes, coldfile != nil ? "coldfile" : "memory", filterbytes);
+	printf("memory allocated: %llu bytes on huge pages, %llu advised for huge pages, %llu on normal pages, %llu interleaved\n",
+		lockedstats.huge, lockedstats.advised, lockedstats.plain, lockedstats.interleaved);
 	free(freqs);
 }
 
 
-static int
-lookup(uchar *score, uchar type, uvlong *addr)
+/*
+ * lookups of up to Lookupbatch scores.  the read locks of the scores of
+ * a shard are taken in order, so the lookups can be interleaved.
+ */
+static void
+safe_lookupbatch(Lookup *l, int n)
 {
-	ulong index;
-	Chain *c;
-	int i, n;
-	uvlong entryaddr;
-
-	nlookups++;
-
-	index = getuvlong(score, 0, headscorewidth);
-
-	n = 0;
-	for(c = &heads[index]; c != nil; c = c->next) {
-		for(i = 0; i < c->n; i++) {
-			entryaddr = getaddr(c, i);
-			if(entryaddr == endaddr)
-				break;
-			if(!istype(type, c, i) || !isscore(score, c, i))
+	Lookup g[Lookupbatch];
+	int gi[Lookupbatch];
+	uchar need[nelem(shards[0].index.locks)];
+	Index *ix;
+	int i, k, m;
+
+	for(k = 0; k < nshards; k++) {
+		ix = &shards[k].index;
+		m = 0;
+		memset(need, 0, sizeof need);
+		for(i = 0; i < n; i++) {
+			if(shardof(l[i].score) != &shards[k])
 				continue;
-			if(n >= Addressesmax)
-				return -1;
-			addr[n++] = entryaddr;
+			gi[m] = i;
+			g[m++] = l[i];
+			need[indexlockof(ix, l[i].score) - ix->locks] = 1;
 		}
+		if(m == 0)
+			continue;
+		for(i = 0; i < nelem(need); i++)
+			if(need[i])
+				rlock(&ix->locks[i]);
+		nlookups += m;
+		indexlookupbatch(ix, g, m, Addressesmax);
+		for(i = 0; i < nelem(need); i++)
+			if(need[i])
+				runlock(&ix->locks[i]);
+		for(i = 0; i < m; i++)
+			l[gi[i]].n = g[i].n;
 	}
-	return n;
-}
-
-
-static uchar *
-bufalloc(int n)
-{
-	uchar *p;
-
-	if(n == 0)
-		return nil;
-
-	if(mem == nil || mem+n >= memend) {
-		mem = lockedmalloc(Bufallocsize);
-		if(mem == nil)
-			return nil;
-		memend = mem+Bufallocsize;
-		memset(mem, (uchar)0xff, Bufallocsize);
-	}
-	p = mem;
-	mem += n;
-	return p;
-}
-
-
-static Chain *
-chainalloc(int n)
-{
-	static Chain *b = nil;
-	static Chain *e = nil;
-	Chain *newb;
-	uchar *p;
-
-	if(b == nil || b >= e) {
-		newb = lockedmalloc(sizeof newb[0] * Chainallocn);
-		if(newb == nil)
-			return nil;
-		b = newb;
-		e = &b[Chainallocn];
-	}
-	n = MAX(n, Chainentriesmin);
-	p = bufalloc(roundup(n*mementrysize, 8)/8);
-	if(p == nil)
-		return nil;
-	b->data = p;
-	b->next = nil;
-	b->n = n;
-	return b++;
-}
-
-
-static void
-putentry(Chain *c, int i, uchar *score, uchar type, uvlong addr)
-{
-	int bitoffset;
-	uvlong n;
-
-	c->data[i] = type;
-	bitoffset = 8*c->n+(entryscorewidth+addrwidth)*i;
-	n = getuvlong(score, headscorewidth, entryscorewidth);
-	putuvlong(c->data, n, bitoffset, entryscorewidth);
-	putuvlong(c->data, addr, bitoffset+entryscorewidth, addrwidth);
 }
 
 
 static int
-insert(uchar *score, uchar type, uvlong addr)
+lookup(Shard *sh, uchar *score, uchar type, uvlong *addr)
 {
-	ulong index;
-	int i;
-	Chain *c;
-	int headlen;
-	int nalloc;
-
-	index = getuvlong(score, 0, headscorewidth);
-
-	c = &heads[index];
-	while(c->next != nil)
-		c = c->next;
-
-	for(i = 0; i < c->n; i++) {
-		if(!isend(c, i))
-			continue;
-		putentry(c, i, score, type, addr);
-		return 1;
-	}
-
-	if(c == &heads[index] && c->n == 0) {
-		c->data = bufalloc(roundup(Chainentriesmin*mementrysize, 8)/8);
-		if(c->data == nil)
-			return 0;
-		c->n = Chainentriesmin;
-	} else {
-		headlen = headcount(&heads[index]);
-		nalloc = MIN(255, MAX(0, (int)initheadlen - headlen));
-		nalloc = 0;
-		c->next = chainalloc(nalloc);
-		if(c->next == nil)
-			return 0;
-		c = c->next;
-	}
-	putentry(c, 0, score, type, addr);
-	return 1;
+	nlookups++;
+	return indexlookup(&sh->index, score, type, addr, Addressesmax);
 }
 
 
 static uvlong
-disklookup(uvlong *addr, int naddr, uchar *score, uchar type, int readdata, uchar *data, DHeader *dh, char **errmsg)
+disklookup(uvlong *addr, int naddr, uchar *score, uchar type, uchar *data, uchar **datap, DHeader *dh, char **errmsg)
 {
 	int i;
 	char *err;
 	uchar diskscore[Scoresize];
+	uchar *h, *p;
 	uvlong offset;
-	int n;
+	int n, r;
 	int want;
 
 	diskhisto[naddr] += 1;
 
 	want = Diskdheadersize;
-	if(readdata)
+	if(datap != nil)
 		want += 8*1024;
 
+	/* with the datafile mapped, start reading all candidate headers at once */
+	if(disk.mapped && naddr > 1)
+		for(i = 0; i < naddr; i++)
+			dataprefetch(&disk, addr[i], Diskdheadersize);
+
 	*errmsg = nil;
 	for(i = 0; i < naddr; i++) {
 		offset = addr[i];
-		n = preadn(datafd, data, want, offset);
+		h = datamapped(&disk, offset, Diskdheadersize);
+		n = Diskdheadersize;
+		if(h == nil) {
+			h = data;
+			n = dataread(&disk, data, want, offset);
+		}
 		if(n <= 0) {
 			*errmsg = "error reading header";
 			syslog_r(LOG_WARNING, &sdata, "disklookup: error reading header for block at offset=%llu, score=%s type=%d: %s",
@@ -353,7 +401,7 @@ disklookup(uvlong *addr, int naddr, uchar *score, uchar type, int readdata, ucha
 			continue;
 		}
 
-		err = unpackdheader(data, dh);
+		err = unpackdheader(h, dh);
 		if(err != nil) {
 			*errmsg = err;
 			syslog_r(LOG_WARNING, &sdata, "disklookup: unpacking header for block at offset=%llu, score=%s type=%d: %s",
@@ -364,29 +412,45 @@ disklookup(uvlong *addr, int naddr, uchar *score, uchar type, int readdata, ucha
 		if(memcmp(score, dh->score, Scoresize) != 0 || dh->type != type)
 			continue;
 
-		if(readdata) {
-			if(dh->size > n-Diskdheadersize) {
-				n = preadn(datafd, data, dh->size, offset+Diskdheadersize);
-				if(n <= 0) {
+		/*
+		 * *datap is set to the data, in the mapped datafile or
+		 * after the header in data.
+		 */
+		if(datap != nil) {
+			p = nil;
+			if(h != data && dh->size > 0) {
+				dataprefetch(&disk, offset+Diskdheadersize, dh->size);
+				p = datamapped(&disk, offset+Diskdheadersize, dh->size);
+			}
+			if(p == nil) {
+				if(h != data) {
+					memmove(data, h, Diskdheadersize);
+					n = Diskdheadersize;
+				}
+				p = data+Diskdheadersize;
+			}
+			if(p == data+Diskdheadersize && dh->size > n-Diskdheadersize) {
+				want = Diskdheadersize+dh->size-n;
+				r = dataread(&disk, data+n, want, offset+n);
+				if(r <= 0) {
 					*errmsg = "disklookup: error reading data";
 					syslog_r(LOG_WARNING, &sdata, "error reading data for block at offset=%llu, score=%s type=%d: %s",
-						offset, scorestr(score), (int)type, (n < 0) ? strerror(errno) : "end of file");
+						offset, scorestr(score), (int)type, (r < 0) ? strerror(errno) : "end of file");
 				}
-				if(n != dh->size) {
+				if(r != want) {
 					*errmsg = "disklookup: short read for data";
 					syslog_r(LOG_WARNING, &sdata, "short read for data for block at offset=%llu, have=%d, score=%s type=%d",
-						offset, n, scorestr(score), (int)type);
+						offset, n+r, scorestr(score), (int)type);
 				}
-			} else {
-				memmove(data, data+Diskdheadersize, dh->size);
 			}
-			sha1(diskscore, data, dh->size);
+			sha1(diskscore, p, dh->size);
 			if(memcmp(diskscore, score, Scoresize) != 0) {
 				*errmsg = "score on disk invalid";
 				syslog_r(LOG_ALERT, &sdata, "disklookup: datafile %s has wrong score (has %s, claims %s) in block at offset=%llu size=%d type=%d",
 					datafile, scorestr(diskscore), scorestr(dh->score), offset, (int)dh->size, (int)dh->type);
 				return ~0ULL;
 			}
+			*datap = p;
 		}
 		return offset;
 	}
@@ -395,18 +459,18 @@ disklookup(uvlong *addr, int naddr, uchar *score, uchar type, int readdata, ucha
 
 
 static char *
-indexstore(IHeader *ih)
+indexstore(Shard *sh, IHeader *ih)
 {
 	uchar ihbuf[Diskiheadersize];
 	int n;
 	static char errmsg[512];
 
 	packiheader(ihbuf, ih);
-	n = pwrite(indexfd, ihbuf, sizeof ihbuf, indexfilesize);
+	n = pwrite(sh->indexfd, ihbuf, sizeof ihbuf, sh->indexfilesize);
 	if(n <= 0) {
 		snprintf(errmsg, sizeof errmsg,
 			"indexstore: writing header to indexfile %s at offset=%llu for datafile block at offset=%llu: %s",
-			indexfile, indexfilesize, ih->offset, (n < 0) ? strerror(errno) : "end of file");
+			sh->indexfile, sh->indexfilesize, ih->offset, (n < 0) ? strerror(errno) : "end of file");
 		syslog_r(LOG_ALERT, &sdata, "%s", errmsg);
 		return errmsg;
 	}
@@ -414,7 +478,7 @@ indexstore(IHeader *ih)
 		snprintf(errmsg, sizeof errmsg,
 			"indexstore: short write for header to indexfile %s at offset=%llu for datafile block at offset=%llu, "
 			"dangling bytes at end of datafile %s",
-			indexfile, indexfilesize, ih->offset, datafile);
+			sh->indexfile, sh->indexfilesize, ih->offset, datafile);
 		syslog_r(LOG_ALERT, &sdata, "%s", errmsg);
 		return errmsg;
 	}
@@ -422,54 +486,288 @@ indexstore(IHeader *ih)
 }
 
 
-static uvlong
-store(DHeader *dh, uchar *data)
+/* blocks before end are written, for the followers */
+static void
+repladvance(uvlong end)
 {
-	uchar buf[Diskdheadersize];
-	uvlong offset;
-	int n;
+	lock(&repllock);
+	if(end > replend) {
+		replend = end;
+		rwakeupall(&replmore);
+	}
+	unlock(&repllock);
+}
+
+
+/*
+ * a follower becomes live when it has acknowledged everything that was
+ * sent when replproc last found the end of the datafile.  called with
+ * repllock held.
+ */
+static void
+replcatchup(Follower *f)
+{
+	if(f->live || !f->atend || f->acked < f->caught)
+		return;
+	f->live = 1;
+	syslog_r(LOG_NOTICE, &sdata, "replcatchup: follower live at offset=%llu", f->acked);
+}
+
+/*
+ * with -y, wait until the live followers have stored the blocks before
+ * end.  a follower that does not acknowledge them within Acktimeout is
+ * no longer live, and not waited for until it has caught up again.
+ */
+static void
+replwait(uvlong end)
+{
+	Follower *f;
+	uvlong deadline;
+
+	deadline = msec()+Acktimeout;
+	lock(&repllock);
+	for(;;) {
+		for(f = followers; f != nil; f = f->next)
+			if(f->live && f->acked < end)
+				break;
+		if(f == nil)
+			break;
+		if(!rsleepuntil(&replacked, deadline) && msec() >= deadline) {
+			for(f = followers; f != nil; f = f->next)
+				if(f->live && f->acked < end) {
+					f->live = 0;
+					syslog_r(LOG_WARNING, &sdata, "replwait: follower acknowledged up to offset=%llu, not offset=%llu within %dms, not waiting for it until it caught up",
+						f->acked, end, Acktimeout);
+				}
+			break;
+		}
+	}
+	unlock(&repllock);
+}
+
+
+/*
+ * write a run of blocks that go to consecutive addresses in the active
+ * segment of a stream, with a single write for the data and one for the
+ * index entries.  all blocks of a run belong to the same shard.
+ */
+static void
+storerun(Writer *w, Wreq **reqs, int n, uvlong addr, ulong len)
+{
+	struct iovec iov[3*Writebatchmax];
+	uchar hdrs[Writebatchmax][Diskdheadersize];
+	static uchar zeros[1<<Alignshiftmax];
+	uchar ihbuf[Writebatchmax*Diskiheadersize];
 	IHeader ih;
-	char *errmsg;
+	Shard *sh;
+	uvlong off;
+	ulong blen, slot;
+	ssize_t r;
+	int i, niov;
+
+	sh = reqs[0]->shard;
+	off = addr;
+	niov = 0;
+	for(i = 0; i < n; i++) {
+		packdheader(hdrs[i], reqs[i]->dh);
+		iov[niov].iov_base = hdrs[i];
+		iov[niov++].iov_len = Diskdheadersize;
+		iov[niov].iov_base = reqs[i]->data;
+		iov[niov++].iov_len = reqs[i]->dh->size;
+		blen = Diskdheadersize+reqs[i]->dh->size;
+		slot = dataslot(&disk, blen);
+		if(slot > blen) {
+			iov[niov].iov_base = zeros;
+			iov[niov++].iov_len = slot-blen;
+		}
+		toiheader(&ih, reqs[i]->dh, off);
+		packiheader(ihbuf+i*Diskiheadersize, &ih);
+		reqs[i]->addr = off;
+		off += slot;
+	}
 
-	packdheader(buf, dh);
-	offset = datafilesize;
+	debug(LOG_DEBUG, "writing %d blocks, offset=%llu len=%lu", n, addr, len);
 
-	debug(LOG_DEBUG, "writing data, offset=%llu size=%d", offset, (int)dh->size);
+	r = datawritev(&disk, iov, niov, addr);
+	if(r != len) {
+		if(r <= 0)
+			syslog_r(LOG_ALERT, &sdata, "store: writing %d blocks to datafile %s, at offset=%llu: %s",
+				n, datafile, addr, (r < 0) ? strerror(errno) : "end of file");
+		else
+			syslog_r(LOG_ALERT, &sdata, "store: short write for %d blocks, %ld dangling bytes in datafile %s at offset=%llu",
+				n, (long)r, datafile, addr);
+		goto error;
+	}
 
-	n = pwrite(datafd, buf, sizeof buf, offset);
-	if(n <= 0) {
-		syslog_r(LOG_ALERT, &sdata, "store: writing header to datafile %s, block at offset=%llu, %s: %s",
-			datafile, offset, dheaderfmt(dh), (n < 0) ? strerror(errno) : "end of file");
-		return ~0ULL;
+	lock(&sh->indexlock);
+	r = pwriten(sh->indexfd, ihbuf, n*Diskiheadersize, sh->indexfilesize);
+	if(r != n*Diskiheadersize) {
+		syslog_r(LOG_ALERT, &sdata, "store: writing %d headers to indexfile %s at offset=%llu for datafile blocks at offset=%llu: %s, "
+			"dangling bytes in datafile %s",
+			n, sh->indexfile, sh->indexfilesize, addr, (r < 0) ? strerror(errno) : "short write", datafile);
+		unlock(&sh->indexlock);
+		goto error;
 	}
-	if(n != sizeof buf) {
-		syslog_r(LOG_ALERT, &sdata, "store: short write for header, %d dangling bytes at end of datafile %s, block at offset=%llu, %s",
-			n, datafile, offset, dheaderfmt(dh));
-		return ~0ULL;
+	sh->indexfilesize += r;
+	sh->nblocks += n;
+	unlock(&sh->indexlock);
+	/* with a single stream, the datafile is written in order */
+	if(nwriters == 1)
+		repladvance(addr+len);
+	return;
+
+error:
+	for(i = 0; i < n; i++) {
+		reqs[i]->addr = ~0ULL;
+		reqs[i]->err = Ewrite;
 	}
+}
 
-	n = pwrite(datafd, data, dh->size, offset+Diskdheadersize);
-	if(n <= 0) {
-		syslog_r(LOG_ALERT, &sdata, "store: writing data to datafile %s, block at offset=%llu, %s: %s",
-			datafile, offset, dheaderfmt(dh), (n < 0) ? strerror(errno) : "end of file");
-		return ~0ULL;
+
+static void
+storebatch(Writer *w, Wreq *r)
+{
+	Wreq *reqs[Writebatchmax];
+	uvlong addr;
+	ulong len, blen;
+	int n;
+
+	while(r != nil) {
+		addr = dataalloc(&disk, w->stream, dataslot(&disk, Diskdheadersize+r->dh->size));
+		if(addr == ~0ULL) {
+			syslog_r(LOG_ALERT, &sdata, "store: starting new segment of datafile %s: %s",
+				datafile, strerror(errno));
+			r->err = Ewrite;
+			r = r->next;
+			continue;
+		}
+		n = 0;
+		len = 0;
+		for(; r != nil && n < Writebatchmax; r = r->next) {
+			blen = dataslot(&disk, Diskdheadersize+r->dh->size);
+			if(n > 0 && dataappendaddr(&disk, w->stream, len+blen) != addr)
+				break;
+			if(addr+len+blen >= endaddr) {
+				r->err = Efull;
+				continue;
+			}
+			reqs[n++] = r;
+			len += blen;
+		}
+		if(n > 0)
+			storerun(w, reqs, n, addr, len);
 	}
-	if(n != dh->size) {
-		syslog_r(LOG_ALERT, &sdata, "store: short write for data, %d dangling bytes at end of datafile %s, "
-			"block at offset=%llu, %s, header for partly written block remains at end of file!",
-			n+Diskdheadersize, datafile, offset, dheaderfmt(dh));
-		return ~0ULL;
+}
+
+
+/* each stream of the datafile has a writer that stores the blocks queued for it */
+static void *
+writerproc(void *p)
+{
+	Writer *w;
+	Wreq *r, *next, *batch;
+
+	w = p;
+	lock(&w->lock);
+	for(;;) {
+		while(w->first == nil)
+			rsleep(&w->work);
+		batch = w->first;
+		w->first = w->last = nil;
+		unlock(&w->lock);
+
+		storebatch(w, batch);
+
+		lock(&w->lock);
+		/* a request is gone once done is set */
+		for(r = batch; r != nil; r = next) {
+			next = r->next;
+			r->done = 1;
+			w->nqueued--;
+		}
+		rwakeupall(&w->done);
 	}
+	return nil;
+}
 
-	datafilesize += dh->size+Diskdheadersize;
 
-	toiheader(&ih, dh, offset);
-	errmsg = indexstore(&ih);
-	if(errmsg != nil)
-		return ~0ULL;
+/*
+ * with multiple shards, each shard has its own writer.  otherwise the
+ * writer with the shortest queue, the one with most free space if equal.
+ */
+static Writer *
+pickwriter(Shard *sh)
+{
+	Writer *w, *best;
+	int i;
 
-	nblocks++;
-	return offset;
+	if(nshards > 1)
+		return &writers[sh->id];
+	best = &writers[0];
+	for(i = 1; i < nwriters; i++) {
+		w = &writers[i];
+		if(w->nqueued < best->nqueued
+		|| (w->nqueued == best->nqueued && datafree(&disk, w->stream) > datafree(&disk, best->stream)))
+			best = w;
+	}
+	return best;
+}
+
+
+static uvlong
+store(Shard *sh, DHeader *dh, uchar *data, char **errmsg)
+{
+	Writer *w;
+	Wreq r;
+
+	r.shard = sh;
+	r.dh = dh;
+	r.data = data;
+	r.addr = ~0ULL;
+	r.err = nil;
+	r.done = 0;
+	r.next = nil;
+
+	w = pickwriter(sh);
+	lock(&w->lock);
+	if(w->last != nil)
+		w->last->next = &r;
+	else
+		w->first = &r;
+	w->last = &r;
+	w->nqueued++;
+	rwakeup(&w->work);
+	while(!r.done)
+		rsleep(&w->done);
+	unlock(&w->lock);
+
+	*errmsg = r.err;
+	return r.addr;
+}
+
+
+static void
+startwriters(void)
+{
+	Writer *w;
+	pthread_attr_t attrs;
+	int i;
+
+	nwriters = disk.nstreams;
+	for(i = 0; i < nwriters; i++) {
+		w = &writers[i];
+		w->stream = i;
+		w->first = w->last = nil;
+		w->nqueued = 0;
+		if(!lockinit(&w->lock) || !rendezinit(&w->work, &w->lock) || !rendezinit(&w->done, &w->lock))
+			errxsyslog(1, "init writer lock");
+		if(pthread_attr_init(&attrs) != 0
+			|| pthread_attr_setstacksize(&attrs, Stacksize) != 0)
+			errsyslog(1, "error setting stacksize for writerproc");
+		if(pthread_create(&w->thread, &attrs, writerproc, w) != 0)
+			errsyslog(1, "error creating writerproc");
+		pthread_attr_destroy(&attrs);
+	}
 }
 
 
@@ -477,11 +775,13 @@ static int
 safe_lookup(uchar *score, uchar type, uvlong *addr)
 {
 	int n;
+	Shard *sh;
 	RWLock *htl;
 
-	htl = &htlock[GET8(score)];
+	sh = shardof(score);
+	htl = indexlockof(&sh->index, score);
 	rlock(htl);
-	n = lookup(score, type, addr);
+	n = lookup(sh, score, type, addr);
 	runlock(htl);
 	return n;
 }
@@ -490,10 +790,31 @@ safe_lookup(uchar *score, uchar type, uvlong *addr)
 static void
 safe_sync(void)
 {
-	lock(&disklock);
-	fsync(datafd);
-	fsync(indexfd);
-	unlock(&disklock);
+	static uvlong saved;
+	char *errmsg;
+	uvlong pos;
+	int i;
+
+	/* the blocks before the follow position are synced with the others */
+	lock(&followlock);
+	pos = followpos;
+	unlock(&followlock);
+
+	datasync(&disk);
+	for(i = 0; i < nshards; i++)
+		fsync(shards[i].indexfd);
+
+	if(!following)
+		return;
+	lock(&followlock);
+	if(pos != saved) {
+		errmsg = followwrite(followfile, pos);
+		if(errmsg != nil)
+			syslog_r(LOG_WARNING, &sdata, "%s", errmsg);
+		else
+			saved = pos;
+	}
+	unlock(&followlock);
 }
 
 
@@ -516,24 +837,6 @@ stateget(void)
 }
 
 
-static char *
-readiheader(uvlong offset, IHeader *ih)
-{
-	uchar ihbuf[Diskiheadersize];
-	int n;
-
-	n = preadn(indexfd, ihbuf, sizeof ihbuf, offset);
-	if(n < 0)
-		return strerror(errno);
-	if(n == 0)
-		return "end of file";
-	if(n != sizeof ihbuf)
-		return "short read";
-	unpackiheader(ihbuf, ih);
-	return nil;
-}
-
-
 static char *
 readblock(uvlong offset, DHeader *dh, uchar *data)
 {
@@ -542,10 +845,7 @@ readblock(uvlong offset, DHeader *dh, uchar *data)
 	static char errmsg[128];
 	char *msg;
 
-	if(offset+Diskdheadersize > datafilesize)
-		return "offset+size lies outside datafile";
-
-	n = preadn(datafd, dhbuf, sizeof dhbuf, offset);
+	n = dataread(&disk, dhbuf, sizeof dhbuf, offset);
 	if(n < 0) {
 		snprintf(errmsg, sizeof errmsg, "error reading header: %s", strerror(errno));
 		return errmsg;
@@ -561,7 +861,7 @@ readblock(uvlong offset, DHeader *dh, uchar *data)
 		return errmsg;
 	}
 
-	n = preadn(datafd, data, dh->size, offset+Diskdheadersize);
+	n = dataread(&disk, data, dh->size, offset+Diskdheadersize);
 	if(n < 0) {
 		snprintf(errmsg, sizeof errmsg, "error reading data: %s", strerror(errno));
 		return errmsg;
@@ -575,232 +875,1298 @@ readblock(uvlong offset, DHeader *dh, uchar *data)
 }
 
 
+/* verify the block the last index entry of a segment points to, returns the end of the block */
+static uvlong
+checklast(IHeader *ih)
+{
+	DHeader dh;
+	uchar data[Datamax];
+	uchar score[Scoresize];
+	char *errmsg;
+
+	errmsg = readblock(ih->offset, &dh, data);
+	if(errmsg != nil)
+		errxsyslog(1, "error reading disk block at offset=%llu that indexfile claims is the last in its segment: %s",
+			ih->offset, errmsg);
+
+	sha1(score, data, dh.size);
+	if(memcmp(score, dh.score, Scoresize) != 0)
+		errxsyslog(1, "invalid score for block at offset=%llu in datafile, has %s, claims %s",
+			ih->offset, scorestr(score), scorestr(dh.score));
+
+	if(memcmp(ih->indexscore, dh.score, Indexscoresize) != 0)
+		errxsyslog(1, "score in indexfile does not match score in datafile at block at offset=%llu",
+			ih->offset);
+
+	if(ih->type != dh.type)
+		errxsyslog(1, "type in indexfile does not match type in datafile at block at offset=%llu",
+			ih->offset);
+	return ih->offset+dataslot(&disk, Diskdheadersize+dh.size);
+}
+
+
+/*
+ * the shard count and block alignment are fixed when a memventi is
+ * created and recorded in the metadata file.  a memventi without
+ * metadata file has one shard and unaligned blocks.
+ */
+static void
+openmeta(void)
+{
+	Meta meta;
+	struct stat st;
+	char *errmsg;
+	int empty;
+
+	snprintf(metafile, sizeof metafile, "%s.meta", indexfile);
+	errmsg = metaread(metafile, &meta);
+	if(errmsg != nil)
+		errxsyslog(1, "%s", errmsg);
+	if(meta.present) {
+		if(nshardsflag != 0 && nshardsflag != meta.nshards)
+			errxsyslog(1, "memventi has %d shards, shard count cannot be changed", meta.nshards);
+		if(alignflag >= 0 && alignflag != meta.alignshift)
+			errxsyslog(1, "memventi has alignment %d, alignment cannot be changed", 1<<meta.alignshift);
+		nshards = meta.nshards;
+		alignshift = meta.alignshift;
+		return;
+	}
+
+	meta.nshards = nshards = nshardsflag != 0 ? nshardsflag : 1;
+	meta.alignshift = alignshift = alignflag >= 0 ? alignflag : 0;
+	if(tflag)
+		return;
+	empty = stat(indexfile, &st) != 0 && (disk.nsegs == 0 || (segshift == 0 && disk.segs[0].size == 0));
+	if(nshards > 1 && !empty)
+		errxsyslog(1, "cannot shard existing memventi");
+	if(alignshift > 0 && !empty)
+		errxsyslog(1, "cannot align existing memventi");
+	errmsg = metawrite(metafile, &meta);
+	if(errmsg != nil)
+		errxsyslog(1, "%s", errmsg);
+}
+
+
+static void
+shardinit(Shard *sh, int id)
+{
+	char *file;
+
+	sh->id = id;
+	sh->indexfile = emalloc(strlen(indexfile)+16);
+	if(nshards == 1)
+		strcpy(sh->indexfile, indexfile);
+	else
+		sprintf(sh->indexfile, "%s.%d", indexfile, id);
+	sh->indexfd = open(sh->indexfile, tflag ? O_RDONLY : O_RDWR|O_CREAT|O_APPEND, 0600);
+	if(sh->indexfd < 0)
+		errsyslog(1, "opening indexfile %s", sh->indexfile);
+	sh->indexfilesize = filesize(sh->indexfd);
+	/* the writer may be appending an entry */
+	if(tflag)
+		sh->indexfilesize -= sh->indexfilesize % Diskiheadersize;
+	if(sh->indexfilesize % Diskiheadersize != 0)
+		errxsyslog(1, "indexfile %s size not multiple of index header size (%d)",
+			sh->indexfile, (int)Diskiheadersize);
+	sh->nblocks = sh->indexfilesize / Diskiheadersize;
+
+	indexinit(&sh->index, shardbits, headscorewidth-shardbits, entryscorewidth, addrwidth, alignshift);
+	if(coldfile != nil) {
+		file = emalloc(strlen(coldfile)+16);
+		if(nshards == 1)
+			strcpy(file, coldfile);
+		else
+			sprintf(file, "%s.%d", coldfile, id);
+		indexcold(&sh->index, file);
+		free(file);
+	}
+	recentinit(&sh->recent, nrecent/nshards);
+	if(!lockinit(&sh->indexlock) || !lockinit(&sh->flightlock) || !rendezinit(&sh->flightdone, &sh->flightlock))
+		errxsyslog(1, "init shard lock");
+	sh->flights = nil;
+	poolinit(&sh->flightpool, "flight", sizeof (Flight), Flightpoolmax, nil);
+}
+
+
+/* merge the nodes of long heads in the background, so lookups stay fast */
+static void *
+compactproc(void *p)
+{
+	Shard *sh;
+	ulong n;
+
+	sh = p;
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, nil);
+	for(;;) {
+		sleep(Compactinterval);
+		n = indexcompact(&sh->index);
+		if(n > 0)
+			debug(LOG_DEBUG, "compacted %lu heads of shard %d", n, sh->id);
+		while(indexgrow(&sh->index))
+			syslog_r(LOG_NOTICE, &sdata, "heads of shard %d doubled, headscorewidth now %d, entryscorewidth %d",
+				sh->id, sh->index.skipbits+sh->index.headbits, sh->index.entrybits);
+		if(indexfreeze(&sh->index, sh->index.ndynamic))
+			debug(LOG_DEBUG, "froze index of shard %d, %lu entries", sh->id, sh->index.nfrozen);
+	}
+	return nil;
+}
+
+
+static void
+startcompactors(void)
+{
+	pthread_attr_t attrs;
+	int i;
+
+	for(i = 0; i < nshards; i++) {
+		if(pthread_attr_init(&attrs) != 0
+			|| pthread_attr_setstacksize(&attrs, Stacksize) != 0)
+			errsyslog(1, "error setting stacksize for compactproc");
+		if(pthread_create(&shards[i].compactthread, &attrs, compactproc, &shards[i]) != 0)
+			errsyslog(1, "error creating compactproc");
+		pthread_attr_destroy(&attrs);
+	}
+}
+
+
 static void
 init(void)
 {
 	uvlong end;
-	uvlong ioffset, doffset;
+	uvlong doffset;
 	IHeader ih;
+	IHeader *lastih;
 	DHeader dh;
+	Shard *sh;
 	int n;
-	int i;
+	int i, k;
 	char *errmsg;
 	uchar data[Datamax];
 	uchar score[Scoresize];
 	uchar ihbuf[Diskiheadersize];
-	uvlong origiblocks;
 	uvlong len;
 	uvlong off;
 	uvlong nindexadded;
+	uvlong ncompacted;
+	ulong ndynamic;
 	uvlong start, totalstart;
+	uvlong frozenbytes, filterbytes;
+	Index *ix;
 	uvlong dataread;
+	uvlong indexread;
 
 	totalstart = msec();
 
-	datafd = open(datafile, O_RDWR|O_CREAT|O_APPEND, 0600);
-	if(datafd < 0)
-		errsyslog(1, "opening datafile %s", datafile);
-	datafilesize = filesize(datafd);
-	indexfd = open(indexfile, O_RDWR|O_CREAT|O_APPEND, 0600);
-	if(indexfd < 0)
-		errsyslog(1, "opening indexfile %s", indexfile);
-	indexfilesize = filesize(indexfd);
-
-	if(indexfilesize % Diskiheadersize != 0)
-		errxsyslog(1, "indexfile size not multiple of index header size (%d)", (int)Diskiheadersize);
-
-	/* check if last index entry is valid, if any */
-	doffset = 0;
-	if(indexfilesize > 0) {
-		ioffset = indexfilesize-Diskiheadersize;
-		errmsg = readiheader(ioffset, &ih);
-		if(errmsg != nil)
-			errxsyslog(1, "reading last header from index at offset=%llu: %s", ioffset, errmsg);
-
-		if(ih.offset > datafilesize)
-			errxsyslog(1, "last header at offset=%llu in index point past end of datafile at block at offset=%llu",
-				ioffset, ih.offset);
-
-		errmsg = readblock(ih.offset, &dh, data);
-		if(errmsg != nil)
-			errxsyslog(1, "error reading disk block at offset=%llu that indexfile at offset=%llu claims is the last: %s",
-				ih.offset, ioffset, errmsg);
+	dataopen(&disk, datafiles, ndatafiles, segshift, !tflag);
+	if(mflag)
+		datamap(&disk);
+	openmeta();
+	if(nshards > 1 && segshift == 0)
+		errxsyslog(1, "multiple shards require a segment size");
+	for(shardbits = 0; (1<<shardbits) < nshards; shardbits++)
+		;
+	if(shardbits > headscorewidth)
+		errxsyslog(1, "more shards than heads");
+	if(addrwidth+alignshift > 48)
+		errxsyslog(1, "addrwidth plus alignment too large, maximum is 48 bits");
+	endaddr = (1ULL<<(addrwidth+alignshift))-1;
+	datastreams(&disk, tflag ? 0 : nshards > 1 ? nshards : ndatafiles, alignshift);
+	if(tflag) {
+		n = segshift == 0 ? 1 : Segmax;
+		tailpos = emalloc(sizeof tailpos[0] * n);
+		for(i = 0; i < n; i++)
+			tailpos[i] = (uvlong)i<<segshift;
+	}
 
-		sha1(score, data, dh.size);
-		if(memcmp(score, dh.score, Scoresize) != 0)
-			errxsyslog(1, "invalid score for block at offset=%llu in datafile, has %s, claims %s",
-				ih.offset, scorestr(score), scorestr(dh.score));
+	shards = emalloc(sizeof shards[0] * nshards);
+	for(i = 0; i < nshards; i++)
+		shardinit(&shards[i], i);
 
-		if(memcmp(ih.indexscore, dh.score, Indexscoresize) != 0)
-			errxsyslog(1, "score in indexfile at offset=%llu does not match score in datafile at block at offset=%llu",
-				ioffset, ih.offset);
+	len = 0;
+	for(i = 0; i < nshards; i++)
+		len += shards[i].index.nheads * sizeof shards[i].index.heads[0];
+	debug(LOG_DEBUG, "%llu bytes allocated for heads", len);
 
-		if(ih.type != dh.type)
-			errxsyslog(1, "type in indexfile at offset=%llu does not match score in datafile at block at offset=%llu",
-				ioffset, ih.offset);
-		doffset = ih.offset+Diskdheadersize+dh.size;
+	/* read the indexes into memory, remember the last entry for each segment */
+	lastih = emalloc(sizeof lastih[0] * MAX(1, disk.nsegs));
+	for(i = 0; i < disk.nsegs; i++)
+		lastih[i].offset = ~0ULL;
+	indexread = 0;
+	start = msec();
+	for(k = 0; k < nshards; k++) {
+		sh = &shards[k];
+		end = sh->indexfilesize;
+		off = 0;
+		ndynamic = 0;
+		while(off < end) {
+			n = pread(sh->indexfd, ihbuf, sizeof ihbuf, off);
+			if(n <= 0)
+				errxsyslog(1, "error reading indexfile %s offset=%llu", sh->indexfile, off);
+			if(n != sizeof ihbuf)
+				errxsyslog(1, "short read for indexfile %s offset=%llu, have=%d want=%d", sh->indexfile, off,
+					(int)n, (int)sizeof ihbuf);
+
+			unpackiheader(ihbuf, &ih);
+			i = ih.offset>>segshift;
+			if(segshift == 0)
+				i = 0;
+			if(i >= disk.nsegs || disk.segs[i].fd < 0) {
+				/* a segment started after the datafile was opened, tailproc reads it */
+				if(tflag) {
+					off += sizeof ihbuf;
+					continue;
+				}
+				errxsyslog(1, "header at offset=%llu in index %s points to missing segment of datafile for block at offset=%llu",
+					off, sh->indexfile, ih.offset);
+			}
+			if(shardof(ih.indexscore) != sh)
+				errxsyslog(1, "header at offset=%llu in index %s belongs to other shard", off, sh->indexfile);
+			if(lastih[i].offset == ~0ULL || ih.offset > lastih[i].offset)
+				lastih[i] = ih;
+			if(!indexinsert(&sh->index, ih.indexscore, ih.type, ih.offset))
+				errxsyslog(1, "error inserting in memory for indexfile %s offset=%llu", sh->indexfile, off);
+			/* freeze along the way, the nodes take more memory */
+			if(++ndynamic >= Freezemin && indexfreeze(&sh->index, ndynamic))
+				ndynamic = 0;
+			off += sizeof ihbuf;
+		}
+		indexread += end;
 	}
+	syslog_r(LOG_NOTICE, &sdata, "read %llu bytes in %.3fs from index", indexread, (msec()-start)/1000.0);
 
-	origiblocks = indexfilesize / Diskiheadersize;
-
-	/* read remaining datafile blocks (that are not in indexfile) and add to indexfile */
+	/*
+	 * check if the last index entry of each segment is valid, read the
+	 * datafile blocks after it (that are not in indexfile) and add them
+	 * to the indexfile of their shard.
+	 */
 	dataread = 0;
-	ioffset = indexfilesize;
 	nindexadded = 0;
 	start = msec();
-	while(doffset < datafilesize) {
-		errmsg = readblock(doffset, &dh, data);
-		if(errmsg != nil)
-			errxsyslog(1, "error reading block at offset=%llu (for adding to index): %s",
-				doffset, errmsg);
-		sha1(score, data, dh.size);
-		if(memcmp(score, dh.score, Scoresize) != 0)
-			errxsyslog(1, "invalid score for block at offset=%llu in datafile, has %s, claims %s (for adding to index)",
-				doffset, scorestr(score), scorestr(dh.score));
-		toiheader(&ih, &dh, doffset);
-		errmsg = indexstore(&ih);
+	for(i = 0; i < disk.nsegs; i++) {
+		if(disk.segs[i].fd < 0)
+			continue;
+		doffset = (uvlong)i<<segshift;
+		end = doffset+disk.segs[i].size;
+		if(lastih[i].offset != ~0ULL)
+			doffset = checklast(&lastih[i]);
+		/* the other process indexes them, tailproc adds them in memory */
+		if(tflag) {
+			tailpos[i] = doffset;
+			continue;
+		}
+		while(doffset < end) {
+			errmsg = readblock(doffset, &dh, data);
+			if(errmsg != nil)
+				errxsyslog(1, "error reading block at offset=%llu (for adding to index): %s",
+					doffset, errmsg);
+			sha1(score, data, dh.size);
+			if(memcmp(score, dh.score, Scoresize) != 0)
+				errxsyslog(1, "invalid score for block at offset=%llu in datafile, has %s, claims %s (for adding to index)",
+					doffset, scorestr(score), scorestr(dh.score));
+			sh = shardof(dh.score);
+			toiheader(&ih, &dh, doffset);
+			errmsg = indexstore(sh, &ih);
+			if(errmsg != nil)
+				errxsyslog(1, "could not store newly read datafile block at offset=%llu to indexfile %s at offset=%llu, %s",
+					doffset, sh->indexfile, sh->indexfilesize, dheaderfmt(&dh));
+			if(!indexinsert(&sh->index, ih.indexscore, ih.type, ih.offset))
+				errxsyslog(1, "error inserting in memory for datafile block at offset=%llu", doffset);
+			sh->indexfilesize += Diskiheadersize;
+			sh->nblocks++;
+			doffset += dataslot(&disk, Diskdheadersize+dh.size);
+
+			dataread += Diskdheadersize+dh.size;
+			nindexadded++;
+		}
+	}
+	free(lastih);
+	syslog_r(LOG_NOTICE, &sdata, "added %llu entries from datafile (%llu bytes in datafile) to indexfile, in %.3fs",
+		nindexadded, dataread, (msec()-start)/1000.0);
+
+	/* the heads grew node by node while reading, merge them */
+	start = msec();
+	ncompacted = 0;
+	for(i = 0; i < nshards; i++)
+		ncompacted += indexcompact(&shards[i].index);
+	syslog_r(LOG_NOTICE, &sdata, "compacted %llu heads in %.3fs", ncompacted, (msec()-start)/1000.0);
+
+	/* a store that outgrew headscorewidth gets more heads before serving */
+	len = 0;
+	frozenbytes = filterbytes = 0;
+	for(i = 0; i < nshards; i++) {
+		ix = &shards[i].index;
+		start = msec();
+		if(indexgrow(ix)) {
+			while(indexgrow(ix))
+				;
+			syslog_r(LOG_NOTICE, &sdata, "heads of shard %d doubled to headscorewidth %d, entryscorewidth %d in %.3fs, consider starting with these",
+				i, ix->skipbits+ix->headbits, ix->entrybits, (msec()-start)/1000.0);
+		}
+		indexfreeze(ix, ix->ndynamic);
+		len += ix->nheads * sizeof ix->heads[0];
+		frozenbytes += ix->far.bytes;
+		filterbytes += ix->filt.bytes;
+	}
+	syslog_r(LOG_NOTICE, &sdata, "index frozen in %llu bytes in %s, %llu bytes of filters",
+		frozenbytes, coldfile != nil ? "coldfile" : "memory", filterbytes);
+	syslog_r(LOG_NOTICE, &sdata, "index memory allocated: %llu bytes on huge pages, %llu advised for huge pages, %llu on normal pages, %llu interleaved",
+		lockedstats.huge, lockedstats.advised, lockedstats.plain, lockedstats.interleaved);
+	syslog_r(LOG_NOTICE, &sdata, "init done, %d shards, %llu bytes for heads, entire startup in %.3fs",
+		nshards, len, (msec()-totalstart)/1000.0);
+
+	for(i = 0; i < nelem(diskhisto); i++)
+		diskhisto[i] = 0;
+
+	if(!lockinit(&statelock))
+		errxsyslog(1, "init statelock");
+	if(!lockinit(&repllock) || !rendezinit(&replmore, &repllock) || !rendezinit(&replacked, &repllock)
+		|| !lockinit(&followlock))
+		errxsyslog(1, "init replication locks");
+	if(disk.nstreams == 1)
+		replend = dataappendaddr(&disk, 0, 0);
+}
+
+/* write the pending imported blocks of all streams, then their index entries */
+static void
+importflush(void)
+{
+	Importbuf *ib;
+	Shard *sh;
+	ssize_t n;
+	int i, pending;
+
+	pending = 0;
+	for(i = 0; i < disk.nstreams; i++) {
+		ib = &importbufs[i];
+		if(ib->len == 0)
+			continue;
+		if(dataalloc(&disk, i, ib->len) != ib->addr)
+			errsyslog(1, "import: starting new segment of datafile %s", datafile);
+		n = datawrite(&disk, ib->buf, ib->len, ib->addr);
+		if(n != ib->len)
+			errxsyslog(1, "import: writing %lu bytes to datafile %s at offset=%llu: %s",
+				ib->len, datafile, ib->addr, (n < 0) ? strerror(errno) : "short write");
+		pending = 1;
+	}
+	if(!pending)
+		return;
+	for(i = 0; i < nshards; i++) {
+		sh = &shards[i];
+		n = pwriten(sh->indexfd, sh->importibuf, sh->importilen, sh->indexfilesize);
+		if(n != sh->importilen)
+			errxsyslog(1, "import: writing %lu bytes to indexfile %s at offset=%llu: %s, dangling bytes at end of datafile %s",
+				sh->importilen, sh->indexfile, sh->indexfilesize, (n < 0) ? strerror(errno) : "short write", datafile);
+		sh->indexfilesize += sh->importilen;
+		sh->importilen = 0;
+	}
+	for(i = 0; i < disk.nstreams; i++)
+		importbufs[i].len = 0;
+}
+
+
+/*
+ * like pickwriter:  the shard's own stream with multiple shards,
+ * otherwise the stream with the most free space after its pending blocks.
+ */
+static int
+importstream(Shard *sh)
+{
+	uvlong free, bestfree;
+	int i, best;
+
+	if(nshards > 1)
+		return sh->id;
+	best = 0;
+	bestfree = 0;
+	for(i = 0; i < disk.nstreams; i++) {
+		free = datafree(&disk, i);
+		free = free > importbufs[i].len ? free-importbufs[i].len : 0;
+		if(i == 0 || free > bestfree) {
+			best = i;
+			bestfree = free;
+		}
+	}
+	return best;
+}
+
+
+static void
+importblock(Scan *s, Scanblock *b)
+{
+	uvlong addrs[Addressesmax];
+	uvlong addr;
+	ulong slot;
+	int i, j, n, st;
+	DHeader dh;
+	IHeader ih;
+	Importbuf *ib;
+	Shard *sh;
+	char *errmsg;
+	static uchar buf[Diskdheadersize];
+
+	if(b->err != nil) {
+		syslog_r(LOG_WARNING, &sdata, "import: %s: skipping %lu bytes at offset=%llu: %s",
+			(char *)s->aux, b->len, b->offset, b->err);
+		nimportbad++;
+		return;
+	}
+
+	sh = shardof(b->dh.score);
+	n = lookup(sh, b->dh.score, b->dh.type, addrs);
+	if(n == -1) {
+		syslog_r(LOG_WARNING, &sdata, "import: %s: skipping block at offset=%llu, %s: too many partial matches",
+			(char *)s->aux, b->offset, dheaderfmt(&b->dh));
+		nimportbad++;
+		return;
+	}
+	if(n > 0) {
+		for(i = 0; i < n; i++)
+			for(j = 0; j < disk.nstreams; j++) {
+				ib = &importbufs[j];
+				if(ib->len > 0 && addrs[i] >= ib->addr && addrs[i] < ib->addr+ib->len)
+					importflush();
+			}
+		addr = disklookup(addrs, n, b->dh.score, b->dh.type, buf, nil, &dh, &errmsg);
+		if(addr != ~0ULL) {
+			nimportdup++;
+			return;
+		}
 		if(errmsg != nil)
-			errxsyslog(1, "could not store newly read datafile block at offset=%llu to indexfile at offset=%llu, %s",
-				doffset, ioffset, dheaderfmt(&dh));
-		indexfilesize += Diskiheadersize;
-		ioffset += Diskiheadersize;
-		doffset += Diskdheadersize+dh.size;
+			errxsyslog(1, "import: could not confirm presence of %s: %s", dheaderfmt(&b->dh), errmsg);
+	}
+
+	st = importstream(sh);
+	ib = &importbufs[st];
+	slot = dataslot(&disk, b->len);
+	if(ib->len > 0 && (ib->len+slot > Importbatch || dataappendaddr(&disk, st, ib->len+slot) != ib->addr))
+		importflush();
+	/* allocate right away, streams without a segment yet must not get the same address */
+	if(ib->len == 0 && (ib->addr = dataalloc(&disk, st, slot)) == ~0ULL)
+		errsyslog(1, "import: starting new segment of datafile %s", datafile);
+	addr = ib->addr+ib->len;
+	if(addr+slot >= endaddr)
+		errxsyslog(1, "import: data file is full");
+
+	packdheader(ib->buf+ib->len, &b->dh);
+	memcpy(ib->buf+ib->len+Diskdheadersize, b->data, b->dh.size);
+	memset(ib->buf+ib->len+b->len, 0, slot-b->len);
+	ib->len += slot;
+	toiheader(&ih, &b->dh, addr);
+	packiheader(sh->importibuf+sh->importilen, &ih);
+	sh->importilen += Diskiheadersize;
+
+	if(!indexinsert(&sh->index, b->dh.score, b->dh.type, addr))
+		errxsyslog(1, "import: out of memory for index entry");
+	/* freeze along the way, as init does while reading the indexfile */
+	if(++sh->importdynamic >= Freezemin && indexfreeze(&sh->index, sh->importdynamic))
+		sh->importdynamic = 0;
+	sh->nblocks++;
+	nimported++;
+}
+
+
+static void
+importprefetch(Scan *s, Scanblock *b)
+{
+	indexprefetch(&shardof(b->dh.score)->index, b->dh.score);
+}
+
+
+/*
+ * append the blocks from the datafiles of other memventi's that are
+ * not yet present.  the source files are verified by a pool of procs,
+ * blocks are written in large batches.
+ */
+static void
+import(void)
+{
+	Scan s;
+	struct stat src, dst;
+	int i, j, fd;
+	uvlong start;
+	ulong n;
+
+	for(i = 0; i < disk.nstreams; i++)
+		importbufs[i].buf = emalloc(Importbatch);
+	/*
+	 * a flush writes the entries of the blocks of all streams.  with
+	 * multiple shards, a shard only fills its own stream.
+	 */
+	n = Importbatch/Diskdheadersize+1;
+	if(nshards == 1)
+		n *= disk.nstreams;
+	for(i = 0; i < nshards; i++)
+		shards[i].importibuf = emalloc(n*Diskiheadersize);
+	for(i = 0; i < nimportfiles; i++) {
+		fd = open(importfiles[i], O_RDONLY);
+		if(fd < 0)
+			errsyslog(1, "opening import file %s", importfiles[i]);
+		if(fstat(fd, &src) != 0)
+			errsyslog(1, "fstat import file %s", importfiles[i]);
+		for(j = 0; j < disk.nsegs; j++)
+			if(disk.segs[j].fd >= 0 && fstat(disk.segs[j].fd, &dst) == 0
+			&& src.st_dev == dst.st_dev && src.st_ino == dst.st_ino)
+				errxsyslog(1, "import file %s is part of datafile %s", importfiles[i], datafile);
+
+		start = msec();
+		nimported = nimportdup = nimportbad = 0;
+		memset(&s, 0, sizeof s);
+		s.fd = fd;
+		s.start = 0;
+		s.end = src.st_size;
+		s.nproc = importnproc;
+		s.fn = importblock;
+		s.prefetch = importprefetch;
+		s.aux = importfiles[i];
+		if(!scan(&s))
+			errxsyslog(1, "import: %s: %s", importfiles[i], s.err);
+		importflush();
+		close(fd);
+		if(!datasync(&disk))
+			errsyslog(1, "fsync after import");
+		for(j = 0; j < nshards; j++)
+			if(fsync(shards[j].indexfd) != 0)
+				errsyslog(1, "fsync after import");
+		syslog_r(LOG_NOTICE, &sdata, "imported %s, %llu blocks added, %llu already present, %llu skipped, in %.3fs",
+			importfiles[i], nimported, nimportdup, nimportbad, (msec()-start)/1000.0);
+	}
+	for(i = 0; i < disk.nstreams; i++)
+		free(importbufs[i].buf);
+	for(i = 0; i < nshards; i++)
+		free(shards[i].importibuf);
+}
+
+
+static void
+tailblock(Scan *s, Scanblock *b)
+{
+	uvlong *next;
+	Shard *sh;
+	RWLock *htl;
+	int ok;
+
+	next = s->aux;
+	if(b->err != nil) {
+		/* at the end, the block may still be being written */
+		if(b->offset+b->len == s->base+s->end)
+			return;
+		syslog_r(LOG_WARNING, &sdata, "tail: skipping %lu bytes at offset=%llu: %s", b->len, b->offset, b->err);
+		*next = b->offset+b->len;
+		return;
+	}
+	sh = shardof(b->dh.score);
+	htl = indexlockof(&sh->index, b->dh.score);
+	wlock(htl);
+	ok = indexinsert(&sh->index, b->dh.score, b->dh.type, b->offset);
+	wunlock(htl);
+	if(!ok)
+		errxsyslog(1, "tail: out of memory for index entry");
+	lock(&sh->indexlock);
+	sh->nblocks++;
+	unlock(&sh->indexlock);
+	*next = b->offset+dataslot(&disk, b->len);
+}
+
+
+/*
+ * with -t the datafile is written by another memventi.  it is polled
+ * for growth, the blocks appended are verified and added to the index
+ * in memory.  an incomplete block at the end is read again next time.
+ */
+static void *
+tailproc(void *p)
+{
+	Scan s;
+	Dataseg *seg;
+	uvlong base, next;
+	int i;
+
+	for(;;) {
+		sleep(Tailinterval);
+		datarefresh(&disk);
+		for(i = 0; i < disk.nsegs; i++) {
+			seg = &disk.segs[i];
+			base = (uvlong)i<<disk.segshift;
+			if(seg->fd < 0 || tailpos[i] >= base+seg->size)
+				continue;
+			memset(&s, 0, sizeof s);
+			s.fd = seg->fd;
+			s.base = base;
+			s.start = tailpos[i]-base;
+			s.end = seg->size;
+			s.nproc = importnproc;
+			s.fn = tailblock;
+			s.prefetch = importprefetch;
+			next = tailpos[i];
+			s.aux = &next;
+			if(!scan(&s))
+				syslog_r(LOG_WARNING, &sdata, "tail: %s", s.err);
+			if(next > tailpos[i])
+				debug(LOG_DEBUG, "tail: added blocks at offset=%llu to %llu", tailpos[i], next);
+			tailpos[i] = next;
+		}
+	}
+	return nil;
+}
+
+
+static int
+compatible(char *s)
+{
+	char *ee, *e;
+
+	if(strlen(s) < 6 || strncmp(s, "venti-", 6) != 0)
+		return 0;
+	s += 6;
+	ee = strchr(s, '-');
+	if(ee == nil)
+		return 0;
+	while(s < ee) {
+		e = strchr(s+1, ':');
+		if(e == nil)
+			e = ee;
+		if(e-s == 2 && strncmp(s, "02", 2) == 0)
+			return 1;
+		s = e+1;
+	}
+	return 0;
+}
+
+/* answer a read from the n candidate addresses of its score */
+static void
+readaddrs(Vmsg *in, Vmsg *out, uchar *databuf, uvlong *addrs, int n)
+{
+	uvlong addr;
+	char *errmsg;
+	DHeader dh;
+	uchar *data;
+
+	if(n == 0) {
+		out->op = Rerror;
+		out->msg = "no such score/type";
+		return;
+	}
+	if(n == -1) {
+		out->op = Rerror;
+		out->msg = "internal error (too many partial matches)";
+		return;
+	}
+	addr = disklookup(addrs, n, in->score, in->type, databuf, &data, &dh, &errmsg);
+	if(addr == ~0ULL) {
+		out->op = Rerror;
+		out->msg = "error retrieving data";
+		return;
+	}
+
+	if(dh.size > in->count) {
+		out->op = Rerror;
+		out->msg = "data larger than requested";
+		return;
+	}
+	/* the reply is written from databuf or the mapped datafile */
+	out->data = data;
+	out->dsize = dh.size;
+}
+
+
+static void
+readscore(Vmsg *in, Vmsg *out, uchar *databuf)
+{
+	uvlong addrs[Addressesmax];
+
+	readaddrs(in, out, databuf, addrs, safe_lookup(in->score, in->type, addrs));
+}
+
+
+static void
+writescore(Vmsg *in, Vmsg *out, uchar *databuf)
+{
+	uvlong addrs[Addressesmax];
+	uvlong addr;
+	char *errmsg;
+	DHeader dh;
+	Shard *sh;
+	RWLock *htl;
+	int n, ok, okhdr;
+
+	/*
+	 * duplicates of recent blocks need no disk read and no index lock.
+	 * with -y, a duplicate is answered only when the followers have the
+	 * block too, its first writer may still be waiting for them.
+	 */
+	sh = shardof(out->score);
+	if(recentlookup(&sh->recent, out->score, in->type, &addr)) {
+		if(yflag)
+			replwait(addr+dataslot(&disk, Diskdheadersize+in->dsize));
+		return;
+	}
+
+	htl = indexlockof(&sh->index, out->score);
+	wlock(htl);
+	n = lookup(sh, out->score, in->type, addrs);
+	if(n == -1) {
+		out->op = Rerror;
+		out->msg = "internal error (too many partial matches)";
+		wunlock(htl);
+		return;
+	}
+	if(n > 0) {
+		addr = disklookup(addrs, n, out->score, in->type, databuf, nil, &dh, &errmsg);
+		if(addr != ~0ULL) {
+			wunlock(htl);
+			recentadd(&sh->recent, out->score, in->type, addr);
+			if(yflag)
+				replwait(addr+dataslot(&disk, Diskdheadersize+dh.size));
+			return;
+		}
+		if(errmsg != nil) {
+			wunlock(htl);
+			out->op = Rerror;
+			out->msg = "internal error (could not confirm score presence)";
+			return;
+		}
+	}
+	okhdr = -1;
+	memcpy(dh.score, out->score, Scoresize);
+	dh.type = in->type;
+	dh.size = in->dsize;
+
+	addr = store(sh, &dh, in->data, &errmsg);
+	ok = addr != ~0ULL;
+	if(ok)
+		okhdr = indexinsert(&sh->index, out->score, in->type, addr);
+	wunlock(htl);
+
+	if(!ok && errmsg == Efull) {
+		out->op = Rerror;
+		out->msg = "data file is full";
+		return;
+	}
+	if(!ok) {
+		stateset(Sdegraded);
+		out->op = Rerror;
+		out->msg = "error writing block";
+		syslog_r(LOG_WARNING, &sdata, "connproc: error writing data, degraded to read-only mode");
+		return;
+	}
+	if(okhdr == 0) {
+		stateset(Sdegraded);
+		out->op = Rerror;
+		out->msg = "out of memory";
+		syslog_r(LOG_WARNING, &sdata, "connproc: out of memory for storing index entry, "
+			"data file was written, degraded to read-only mode");
+		return;
+	}
+	recentadd(&sh->recent, out->score, in->type, addr);
+	if(yflag)
+		replwait(addr+dataslot(&disk, Diskdheadersize+dh.size));
+}
+
+
+/*
+ * concurrent requests for the same operation on the same score and type
+ * are coalesced:  the first does the work, the others wait for it and
+ * reply with its result.  many clients starting at once read the same
+ * blocks, and writers of the same new block would otherwise each wait
+ * for the write lock and probe the disk again.
+ */
+static Flight *
+flightjoin(Shard *sh, uchar *score, Vmsg *in, int *leadp)
+{
+	Flight *f;
+	ushort count;
+
+	/* reads with a smaller count may fail where others succeed */
+	count = in->op == Tread ? in->count : 0;
+	lock(&sh->flightlock);
+	for(f = sh->flights; f != nil; f = f->next)
+		if(f->op == in->op && f->type == in->type && f->count == count && memcmp(f->score, score, Scoresize) == 0)
+			break;
+	if(f != nil) {
+		f->nref++;
+		while(!f->done)
+			rsleep(&sh->flightdone);
+		unlock(&sh->flightlock);
+		*leadp = 0;
+		return f;
+	}
+	f = poolget(&sh->flightpool);
+	if(f == nil)
+		errsyslog(1, "malloc");
+	f->op = in->op;
+	memmove(f->score, score, Scoresize);
+	f->type = in->type;
+	f->count = count;
+	f->nref = 1;
+	f->done = 0;
+	f->data = nil;
+	f->next = sh->flights;
+	sh->flights = f;
+	unlock(&sh->flightlock);
+	*leadp = 1;
+	return f;
+}
+
+
+/* callers hold sh->flightlock */
+static void
+flightleave(Shard *sh, Flight *f)
+{
+	if(--f->nref > 0)
+		return;
+	if(f->data != nil)
+		poolput(&datapool, f->data);
+	poolput(&sh->flightpool, f);
+}
+
+
+/* publish the result of the first request to the waiting ones */
+static void
+flightdone(Shard *sh, Flight *f, Vmsg *out)
+{
+	Flight **fp;
+
+	lock(&sh->flightlock);
+	for(fp = &sh->flights; *fp != f; fp = &(*fp)->next)
+		;
+	*fp = f->next;
+	f->rop = out->op;
+	f->msg = out->msg;
+	f->dsize = 0;
+	if(f->nref > 1 && out->data != nil) {
+		f->data = poolget(&datapool);
+		if(f->data == nil) {
+			f->rop = Rerror;
+			f->msg = "out of memory";
+		} else {
+			memcpy(f->data, out->data, out->dsize);
+			f->dsize = out->dsize;
+		}
+	}
+	f->done = 1;
+	rwakeupall(&sh->flightdone);
+	flightleave(sh, f);
+	unlock(&sh->flightlock);
+}
+
+
+/* the result is not changed once done */
+static void
+flightresult(Shard *sh, Flight *f, Vmsg *out, uchar *databuf)
+{
+	out->op = f->rop;
+	out->msg = f->msg;
+	if(f->data != nil) {
+		out->data = databuf+Diskdheadersize;
+		memcpy(out->data, f->data, f->dsize);
+		out->dsize = f->dsize;
+	}
+	lock(&sh->flightlock);
+	flightleave(sh, f);
+	unlock(&sh->flightlock);
+}
+
+
+static void
+coalesce(Shard *sh, uchar *score, Vmsg *in, Vmsg *out, uchar *databuf, void (*fn)(Vmsg *, Vmsg *, uchar *))
+{
+	Flight *f;
+	int lead;
+
+	f = flightjoin(sh, score, in, &lead);
+	if(!lead) {
+		nshared++;
+		flightresult(sh, f, out, databuf);
+		return;
+	}
+	fn(in, out, databuf);
+	flightdone(sh, f, out);
+}
+
+
+static void
+handleread(Vmsg *in, Vmsg *out, uchar *databuf)
+{
+	debug(LOG_DEBUG, "request: op=read score=%s type=%d", scorestr(in->score), (int)in->type);
+	if(memcmp(in->score, zeroscore, Scoresize) == 0) {
+		out->data = nil;
+		out->dsize = 0;
+		return;
+	}
+
+	coalesce(shardof(in->score), in->score, in, out, databuf, readscore);
+}
+
+
+static void
+handlewrite(Vmsg *in, Vmsg *out, uchar *databuf, int allowwrite)
+{
+	if(!allowwrite) {
+		out->op = Rerror;
+		out->msg = "no write access";
+		return;
+	}
+	if(stateget() == Sdegraded) {
+		out->op = Rerror;
+		out->msg = "cannot write";
+		return;
+	}
+
+	if(in->dsize == 0) {
+		memcpy(out->score, zeroscore, Scoresize);
+		return;
+	}
+
+	sha1(out->score, in->data, in->dsize);
+	debug(LOG_DEBUG, "request: op=write score=%s type=%d size=%d",
+		scorestr(out->score), (int)in->type, (int)in->dsize);
+
+	coalesce(shardof(out->score), out->score, in, out, databuf, writescore);
+}
+
+
+/*
+ * the blocks of a Tmread are looked up and prefetched Lookupbatch at a
+ * time, so their disk reads overlap.  they are read from the addresses
+ * found, without looking them up again.
+ */
+static int
+readbatch(Conn *c, Vmsg *in, uchar *databuf)
+{
+	uvlong addrs[Lookupbatch][Addressesmax];
+	Lookup l[Lookupbatch];
+	Vmsg r[Lookupbatch], out;
+	int i, j, k, n;
+
+	for(i = 0; i < in->nbatch; i += n) {
+		n = MIN(Lookupbatch, in->nbatch-i);
+		for(j = 0; j < n; j++) {
+			mreadentry(in, i+j, &r[j]);
+			l[j].score = r[j].score;
+			l[j].type = r[j].type;
+			l[j].addrs = addrs[j];
+		}
+		safe_lookupbatch(l, n);
+		for(j = 0; j < n; j++)
+			for(k = 0; k < l[j].n; k++)
+				dataprefetch(&disk, addrs[j][k], Diskdheadersize+r[j].count);
+		for(j = 0; j < n; j++) {
+			debug(LOG_DEBUG, "request: op=read score=%s type=%d", scorestr(r[j].score), (int)r[j].type);
+			out.op = Rread;
+			out.tag = in->tag;
+			out.data = nil;
+			out.dsize = 0;
+			if(memcmp(r[j].score, zeroscore, Scoresize) != 0)
+				readaddrs(&r[j], &out, databuf, addrs[j], l[j].n);
+			if(writevmsg(c, &out) == 0)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+
+/*
+ * a Tmhave is answered from the index and the headers of the candidate
+ * blocks only.  scores without candidates need no disk access, the
+ * headers of the others are prefetched together.  blocks that cannot
+ * be checked are reported missing, writing them is harmless.
+ */
+static int
+havebatch(Conn *c, Vmsg *in, uchar *databuf)
+{
+	uvlong addrs[Lookupbatch][Addressesmax];
+	uvlong addr;
+	uchar bits[(Mhavemax+7)/8];
+	Lookup l[Lookupbatch];
+	Vmsg r[Lookupbatch], out;
+	int idx[Lookupbatch];
+	char *errmsg;
+	DHeader dh;
+	Shard *sh;
+	int i, j, k, n, m;
+
+	memset(bits, 0, sizeof bits);
+	for(i = 0; i < in->nbatch; i += n) {
+		n = MIN(Lookupbatch, in->nbatch-i);
+		m = 0;
+		for(j = 0; j < n; j++) {
+			mhaveentry(in, i+j, &r[m]);
+			if(memcmp(r[m].score, zeroscore, Scoresize) == 0
+			|| recentlookup(&shardof(r[m].score)->recent, r[m].score, r[m].type, &addr)) {
+				bits[(i+j)/8] |= 1<<((i+j)%8);
+				continue;
+			}
+			l[m].score = r[m].score;
+			l[m].type = r[m].type;
+			l[m].addrs = addrs[m];
+			idx[m++] = i+j;
+		}
+		safe_lookupbatch(l, m);
+		for(j = 0; j < m; j++)
+			for(k = 0; k < l[j].n; k++)
+				dataprefetch(&disk, addrs[j][k], Diskdheadersize);
+		for(j = 0; j < m; j++) {
+			if(l[j].n <= 0)
+				continue;
+			addr = disklookup(addrs[j], l[j].n, r[j].score, r[j].type, databuf, nil, &dh, &errmsg);
+			if(addr == ~0ULL)
+				continue;
+			sh = shardof(r[j].score);
+			recentadd(&sh->recent, r[j].score, r[j].type, addr);
+			bits[idx[j]/8] |= 1<<(idx[j]%8);
+		}
+	}
+	out.op = Rmhave;
+	out.tag = in->tag;
+	out.nbatch = in->nbatch;
+	out.data = bits;
+	return writevmsg(c, &out);
+}
+
 
-		dataread += Diskdheadersize+dh.size;
-		nindexadded++;
+static int
+writebatch(Conn *c, Vmsg *in, uchar *databuf, int allowwrite)
+{
+	Vmsg w, out;
+	uchar *p;
+	int i;
+
+	p = in->data;
+	for(i = 0; i < in->nbatch; i++) {
+		p = mwriteentry(p, &w);
+		w.tag = in->tag;
+		out.op = Rwrite;
+		out.tag = in->tag;
+		out.data = nil;
+		handlewrite(&w, &out, databuf, allowwrite);
+		if(writevmsg(c, &out) == 0)
+			return 0;
 	}
-	syslog_r(LOG_NOTICE, &sdata, "added %llu entries from datafile (%llu bytes in datafile) to indexfile, in %.3fs",
-		nindexadded, dataread, (msec()-start)/1000.0);
-	nblocks = indexfilesize / Diskiheadersize;
+	return 1;
+}
 
-	nheads = 1<<headscorewidth;
-	len = nheads * sizeof heads[0];
-	heads = lockedmalloc(len);
-	if(heads == nil)
-		errsyslog(1, "malloc for initial heads, %llu bytes", len);
-	debug(LOG_DEBUG, "%llu bytes allocated for heads", len);
 
-	initheadlen = (nheads > 0) ? nblocks / nheads : 0;
-	len = nheads * roundup(initheadlen*mementrysize, 8)/8;
-	mem = malloc(len);
-	if(mem == nil)
-		errsyslog(1, "no memory for initial index entries");
-	memset(mem, 0xff, len);
-	memend = mem+len;
-	debug(LOG_DEBUG, "%llu bytes allocated for initial entries in index", len);
+/*
+ * read the block at *posp into buf, with its header.  at the end of a
+ * segment *posp moves on to the next segment.  returns the length of
+ * the block, 0 when *posp reached end and -1 on error.
+ */
+static long
+replread(uvlong *posp, uvlong end, uchar *buf, char **errmsg)
+{
+	static char Eshort[] = "short read";
+	static char Eheader[] = "no valid block header";
+	DHeader dh;
+	uvlong pos;
+	ssize_t n;
 
-	for(i = 0; i < nheads; i++) {
-		heads[i].n = 0;
-		heads[i].next = nil;
-		heads[i].data = nil;
+	for(pos = *posp; pos < end; pos = ((pos>>disk.segshift)+1)<<disk.segshift) {
+		*posp = pos;
+		n = dataread(&disk, buf, Diskdheadersize, pos);
+		if(n == 0 && disk.segshift > 0)
+			continue;
+		*errmsg = n < 0 ? strerror(errno) : Eshort;
+		if(n != Diskdheadersize)
+			return -1;
+		*errmsg = Eheader;
+		if(unpackdheader(buf, &dh) != nil)
+			return -1;
+		n = dataread(&disk, buf+Diskdheadersize, dh.size, pos+Diskdheadersize);
+		*errmsg = n < 0 ? strerror(errno) : Eshort;
+		if(n != dh.size)
+			return -1;
+		return Diskdheadersize+dh.size;
 	}
+	*posp = pos;
+	return 0;
+}
 
-	end = indexfilesize;
-	off = 0;
-	start = msec();
-	while(off < end) {
-		n = pread(indexfd, ihbuf, sizeof ihbuf, off);
-		if(n <= 0)
-			errxsyslog(1, "error reading indexfile offset=%llu", off);
-		if(n != sizeof ihbuf)
-			errxsyslog(1, "short read for indexfile offset=%llu, have=%d want=%d", off,
-				(int)n, (int)sizeof ihbuf);
-			
-		unpackiheader(ihbuf, &ih);
-		if(!insert(ih.indexscore, ih.type, ih.offset))
-			errxsyslog(1, "error inserting in memory for indexfile offset=%llu", off);
-		off += sizeof ihbuf;
-	}
-	syslog_r(LOG_NOTICE, &sdata, "init done, %llu bytes for heads, read %llu bytes in %.3fs from index, entire startup in %.3fs",
-		len, indexfilesize, (msec()-start)/1000.0, (msec()-totalstart)/1000.0);
-
-	for(i = 0; i < nelem(diskhisto); i++)
-		diskhisto[i] = 0;
 
-	if(!lockinit(&statelock))
-		errxsyslog(1, "init statelock");
-	if(!lockinit(&disklock))
-		errxsyslog(1, "init disklock");
-	for(i = 0; i < nelem(htlock); i++)
-		if(!rwlockinit(&htlock[i]))
-			errxsyslog(1, "init hash table lock");
+/*
+ * sends the blocks of the datafile to a follower in datafile order,
+ * waiting for new blocks at the end.  the replies are flushed before
+ * waiting.
+ */
+static void *
+replproc(void *p)
+{
+	Follower *f;
+	Vmsg m;
+	uvlong pos, end;
+	char *errmsg;
+	long n;
+
+	f = p;
+	pos = f->pos;
+	m.op = Rfollow;
+	m.tag = f->tag;
+	lock(&repllock);
+	while(!f->done) {
+		if(pos >= replend) {
+			f->pos = f->caught = pos;
+			f->atend = 1;
+			replcatchup(f);
+			unlock(&repllock);
+			if(!connflush(f->c)) {
+				lock(&repllock);
+				break;
+			}
+			lock(&repllock);
+			if(pos >= replend && !f->done)
+				rsleep(&replmore);
+			continue;
+		}
+		end = replend;
+		unlock(&repllock);
+		for(;;) {
+			n = replread(&pos, end, f->buf, &errmsg);
+			if(n <= 0)
+				break;
+			m.addr = pos+dataslot(&disk, n);
+			m.data = f->buf;
+			m.dsize = n;
+			if(writevmsg(f->c, &m) == 0) {
+				n = -1;
+				errmsg = nil;
+				break;
+			}
+			pos = m.addr;
+		}
+		lock(&repllock);
+		if(n < 0) {
+			if(errmsg != nil)
+				syslog_r(LOG_ALERT, &sdata, "replproc: reading datafile %s at offset=%llu: %s, stopping follower",
+					datafile, pos, errmsg);
+			break;
+		}
+	}
+	unlock(&repllock);
+	shutdown(f->c->fd, SHUT_RDWR);
+	return nil;
 }
 
-static int
-compatible(char *s)
+
+/*
+ * a Tfollow turns the connection into a replication stream.  replproc
+ * sends the blocks, the connection reads the acknowledgements until the
+ * follower goes away.
+ */
+static void
+follow(Conn *c, Vmsg *in, uchar *databuf)
 {
-	char *ee, *e;
+	Follower f, **fp;
+	Vmsg m;
+	pthread_t thread;
+	pthread_attr_t attrs;
 
-	if(strlen(s) < 6 || strncmp(s, "venti-", 6) != 0)
-		return 0;
-	s += 6;
-	ee = strchr(s, '-');
-	if(ee == nil)
-		return 0;
-	while(s < ee) {
-		e = strchr(s+1, ':');
-		if(e == nil)
-			e = ee;
-		if(e-s == 2 && strncmp(s, "02", 2) == 0)
-			return 1;
-		s = e+1;
+	m.op = Rerror;
+	m.tag = in->tag;
+	m.msg = nil;
+	lock(&repllock);
+	if(nwriters != 1)
+		m.msg = "cannot follow a datafile not written by a single stream";
+	else if(in->addr > replend)
+		m.msg = "position beyond end of datafile";
+	if(m.msg != nil) {
+		unlock(&repllock);
+		syslog_r(LOG_WARNING, &sdata, "follow: %s", m.msg);
+		writevmsg(c, &m);
+		return;
 	}
-	return 0;
+	unlock(&repllock);
+	f.c = c;
+	f.tag = in->tag;
+	f.buf = databuf;
+	f.pos = f.caught = f.acked = in->addr;
+	f.atend = 0;
+	f.live = 0;
+	f.done = 0;
+
+	/* replproc only uses f and the replication globals, it may start before f is registered */
+	if(pthread_attr_init(&attrs) != 0) {
+		syslog_r(LOG_WARNING, &sdata, "follow: could not create process: %s", strerror(errno));
+		return;
+	}
+	if(pthread_attr_setstacksize(&attrs, Stacksize) != 0
+		|| pthread_create(&thread, &attrs, replproc, &f) != 0) {
+		syslog_r(LOG_WARNING, &sdata, "follow: could not create process: %s", strerror(errno));
+		pthread_attr_destroy(&attrs);
+		return;
+	}
+	pthread_attr_destroy(&attrs);
+	lock(&repllock);
+	f.next = followers;
+	followers = &f;
+	unlock(&repllock);
+	syslog_r(LOG_NOTICE, &sdata, "follow: follower starting at offset=%llu", in->addr);
+
+	while(readvmsg(c, &m) && m.op == Tack) {
+		lock(&repllock);
+		if(m.addr > f.acked) {
+			f.acked = m.addr;
+			replcatchup(&f);
+			rwakeupall(&replacked);
+		}
+		unlock(&repllock);
+	}
+
+	lock(&repllock);
+	f.done = 1;
+	rwakeupall(&replmore);
+	unlock(&repllock);
+	shutdown(c->fd, SHUT_RDWR);
+	pthread_join(thread, nil);
+	lock(&repllock);
+	for(fp = &followers; *fp != &f; fp = &(*fp)->next)
+		;
+	*fp = f.next;
+	rwakeupall(&replacked);
+	unlock(&repllock);
+	syslog_r(LOG_NOTICE, &sdata, "follow: follower gone, acknowledged up to offset=%llu", f.acked);
 }
 
+
 static void *
 connproc(void *p)
 {
 	int fd;
-	FILE *f;
+	Conn *c;
 	Vmsg in, out;
 	char buf[128];
 	char *l;
 	char handshake[] = "venti-02-memventi\n";
-	DHeader dh;
-	int ok, okhdr;
 	int len;
 	int allowwrite;
+	int batch, ok;
 	Args *args;
-	int n;
-	uvlong addr;
-	uvlong addrs[Addressesmax];
-	char *errmsg;
-	RWLock *htl;
 	uchar *databuf;
 
 	args = (Args *)p;
 	fd = args->fd;
 	allowwrite = args->allowwrite;
 	databuf = args->buf;
-	free(p);
-
-	in.data = nil;
+	c = &args->conn;
 
 	debug(LOG_DEBUG, "connproc: started, fd %d", fd);
 
-	f = fdopen(fd, "r");
-	if(f == nil) {
-		debug(LOG_DEBUG, "connproc: fdopen on fd %d: %s", fd, strerror(errno));
-		goto done;
-	}
+	conninit(c, fd, databuf, Connbufsize);
 
 	if(write(fd, handshake, strlen(handshake)) != strlen(handshake)) {
 		debug(LOG_DEBUG, "error writing protocol handshake: %s", strerror(errno));
 		goto done;
 	}
 
-	l = fgets(buf, sizeof buf, f);
+	l = connline(c, buf, sizeof buf);
 	if(l == nil || !compatible(l)) {
-		debug(LOG_DEBUG, "error reading protocol handshake or wrong protocol version: %s",
-			ferror(f) ? strerror(errno) : "eof");
+		debug(LOG_DEBUG, "error reading protocol handshake or wrong protocol version");
 		goto done;
 	}
 	if(l != nil && (len = strlen(l)) > 0 && l[len-1] == '\n')
 		l[len-1] = '\0';
 	debug(LOG_DEBUG, "connproc: have handshake version %s", l);
 
-	if(readvmsg(f, &in, databuf) == 0) {
+	if(readvmsg(c, &in) == 0) {
 		debug(LOG_DEBUG, "error reading hello msg");
 		goto done;
 	}
@@ -809,9 +2175,11 @@ connproc(void *p)
 		goto done;
 	}
 	debug(LOG_DEBUG, "connproc: have hello message");
+	batch = in.ext;
 	out.op = in.op+1;
 	out.tag = in.tag;
-	if(writevmsg(fd, &out, databuf) == 0) {
+	out.ext = batch;
+	if(writevmsg(c, &out) == 0) {
 		debug(LOG_DEBUG, "error writing hello venti reponse");
 		goto done;
 	}
@@ -819,11 +2187,12 @@ connproc(void *p)
 
 	out.data = nil;
 	for(;;) {
-		free(in.data);
-		in.data = nil;
-		errmsg = nil;
-
-		if(readvmsg(f, &in, databuf) == 0)
+		/* replies to pipelined requests are written together */
+		if(!connpending(c) && connflush(c) == 0) {
+			debug(LOG_DEBUG, "error writing venti responses");
+			goto done;
+		}
+		if(readvmsg(c, &in) == 0)
 			goto done;
 
 		if(stateget() == Sclosing) {
@@ -831,7 +2200,7 @@ connproc(void *p)
 				goto done;
 			out.op = Rerror;
 			out.msg = "venti shutting down";
-			if(writevmsg(fd, &out, databuf) == 0)
+			if(writevmsg(c, &out) == 0)
 				debug(LOG_DEBUG, "error writing venti shutdown message");
 			goto done;
 		}
@@ -846,126 +2215,34 @@ connproc(void *p)
 			goto done;
 			break;
 		case Tread:
-			debug(LOG_DEBUG, "request: op=read score=%s type=%d", scorestr(in.score), (int)in.type);
-			if(memcmp(in.score, zeroscore, Scoresize) == 0) {
-				out.data = nil;
-				out.dsize = 0;
-				break;
-			}
-
-			n = safe_lookup(in.score, in.type, addrs);
-			if(n == 0) {
-				out.op = Rerror;
-				out.msg = "no such score/type";
-				break;
-			}
-			if(n == -1) {
-				out.op = Rerror;
-				out.msg = "internal error (too many partial matches)";
-				break;
-			}
-			addr = disklookup(addrs, n, in.score, in.type, 1, databuf, &dh, &errmsg);
-			if(addr == ~0ULL) {
-				out.op = Rerror;
-				out.msg = "error retrieving data";
-				break;
-			}
-
-			if(dh.size > in.count) {
-				out.op = Rerror;
-				out.msg = "data larger than requested";
-			} else {
-				out.data = trymalloc(dh.size);
-				if(out.data == nil) {
-					out.op = Rerror;
-					out.msg = "out of memory";
-					syslog_r(LOG_WARNING, &sdata, "connproc: out of memory for read of size %u", (uint)dh.size);
-					break;
-				}
-				memcpy(out.data, databuf, dh.size);
-				out.dsize = dh.size;
-			}
+			handleread(&in, &out, databuf);
 			break;
 		case Twrite:
-			if(!allowwrite) {
-				out.op = Rerror;
-				out.msg = "no write access";
-				break;
-			}
-			if(stateget() == Sdegraded) {
-				out.op = Rerror;
-				out.msg = "cannot write";
-				break;
-			}
-
-			if(in.dsize == 0) {
-				memcpy(out.score, zeroscore, Scoresize);
-				break;
-			}
-
-			sha1(out.score, in.data, in.dsize);
-			debug(LOG_DEBUG, "request: op=write score=%s type=%d size=%d",
-				scorestr(out.score), (int)in.type, (int)in.dsize);
-
-			htl = &htlock[GET8(out.score)];
-			wlock(htl);
-			n = lookup(out.score, in.type, addrs);
-			if(n == -1) {
-				out.op = Rerror;
-				out.msg = "internal error (too many partial matches)";
-				wunlock(htl);
-				break;
-			}
-			if(n > 0) {
-				addr = disklookup(addrs, n, out.score, in.type, 0, databuf, &dh, &errmsg);
-				if(addr != ~0ULL) {
-					wunlock(htl);
-					break;
-				}
-				if(errmsg != nil) {
-					wunlock(htl);
-					out.op = Rerror;
-					out.msg = "internal error (could not confirm score presence)";
-					break;
-				}
+			handlewrite(&in, &out, databuf, allowwrite);
+			break;
+		case Tmread:
+		case Tmwrite:
+		case Tmhave:
+		case Tfollow:
+			if(!batch) {
+				syslog_r(LOG_NOTICE, &sdata, "batch op %d not negotiated", in.op);
+				goto done;
 			}
-			okhdr = -1;
-			memcpy(dh.score, out.score, Scoresize);
-			dh.type = in.type;
-			dh.size = in.dsize;
-
-			if(datafilesize+Diskdheadersize+dh.size >= endaddr) {
-				wunlock(htl);
-				out.op = Rerror;
-				out.msg = "data file is full";
-				break;
+			if(in.op == Tfollow) {
+				follow(c, &in, databuf);
+				goto done;
 			}
-
-			lock(&disklock);
-			addr = store(&dh, in.data);
-			unlock(&disklock);
-
-			ok = addr != ~0ULL;
-			if(ok)
-				okhdr = insert(out.score, in.type, addr);
-			wunlock(htl);
-
+			if(in.op == Tmread)
+				ok = readbatch(c, &in, databuf);
+			else if(in.op == Tmhave)
+				ok = havebatch(c, &in, databuf);
+			else
+				ok = writebatch(c, &in, databuf, allowwrite);
 			if(!ok) {
-				stateset(Sdegraded);
-				out.op = Rerror;
-				out.msg = "error writing block";
-				syslog_r(LOG_WARNING, &sdata, "connproc: error writing data, degraded to read-only mode");
-				break;
-			}
-			if(okhdr == 0) {
-				stateset(Sdegraded);
-				out.op = Rerror;
-				out.msg = "out of memory";
-				syslog_r(LOG_WARNING, &sdata, "connproc: out of memory for storing index entry, "
-					"data file was written, degraded to read-only mode");
-				break;
+				debug(LOG_DEBUG, "error writing venti response");
+				goto done;
 			}
-			break;
+			continue;
 		case Tsync:
 			if(allowwrite)
 				safe_sync();
@@ -983,34 +2260,41 @@ connproc(void *p)
 		}
 
 		debug(LOG_DEBUG, "connproc: have response for request");
-		if(writevmsg(fd, &out, databuf) == 0) {
+		if(writevmsg(c, &out) == 0) {
 			debug(LOG_DEBUG, "error writing venti response");
-			free(out.data);
-			out.data = nil;
 			goto done;
 		}
-		free(out.data);
 		out.data = nil;
 		debug(LOG_DEBUG, "connproc: response for request written");
 	}
 
 done:
-	free(in.data);
-	free(databuf);
-	if(f != nil)
-		fclose(f);
+	connflush(c);
 	close(fd);
+	poolput(&connpool, args);
 	debug(LOG_DEBUG, "connproc: done");
 	return nil;
 }
 
 
+/* for Args freed by connpool */
+static void
+releaseargs(void *p)
+{
+	Args *args;
+
+	args = p;
+	free(args->buf);
+	connfree(&args->conn);
+}
+
+
 static void *
 listenproc(void *p)
 {
 	struct sockaddr_storage addr;
 	socklen_t len;
-	pthread_t *thread;
+	pthread_t thread;
 	Args *args;
 	int fd;
 	int listenfd, allowwrite;
@@ -1025,38 +2309,36 @@ listenproc(void *p)
 
 	syslog_r(LOG_NOTICE, &sdata, "listenproc: accepting connections...");
 	for(;;) {
-		fd = accept(listenfd, (struct sockaddr *)&addr, &len);
+		len = sizeof addr;
+		fd = accept4(listenfd, (struct sockaddr *)&addr, &len, SOCK_CLOEXEC);
 		if(fd < 0)
 			continue;
+		if(nodelay && addr.ss_family != AF_UNIX && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay) != 0)
+			debug(LOG_DEBUG, "listenproc: setting TCP_NODELAY: %s", strerror(errno));
 
-		thread = nil;
-		args = malloc(sizeof args[0]);
+		args = poolget(&connpool);
 		if(args == nil)
 			goto error;
 		args->fd = fd;
 		args->allowwrite = allowwrite;
-		args->buf = malloc(Datamax+8);
+		if(args->buf == nil)
+			args->buf = malloc(Connbufsize);
 		if(args->buf == nil)
 			goto error;
 
-		thread = malloc(sizeof thread[0]);
-		if(thread == nil)
-			goto error;
 		if(pthread_attr_init(&attrs) != 0
 			|| pthread_attr_setstacksize(&attrs, Stacksize) != 0
 			|| pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_DETACHED) != 0)
 			goto error;
-		if(pthread_create(thread, &attrs, connproc, args) != 0)
+		if(pthread_create(&thread, &attrs, connproc, args) != 0)
 			goto error;
 		pthread_attr_destroy(&attrs);
-		free(thread);
 		continue;
 
 	error:
 		if(args != nil)
-			free(args->buf);
-		free(args);
-		free(thread);
+			poolput(&connpool, args);
+		close(fd);
 		syslog_r(LOG_WARNING, &sdata, "listenproc: could not create process: %s", strerror(errno));
 	}
 	return nil;
@@ -1079,7 +2361,7 @@ signalproc(void *p)
 {
 	int sig;
 	sigset_t mask;
-	int i;
+	int i, j;
 
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGINT);
@@ -1103,17 +2385,14 @@ signalproc(void *p)
 		case SIGTERM:
 			stateset(Sclosing);
 			syslog_r(LOG_INFO, &sdata, "closing down");
-			for(i = 0; i < nreadlistens; i++)
-				pthread_cancel(readlistenthread[i]);
-			for(i = 0; i < nwritelistens; i++)
-				pthread_cancel(writelistenthread[i]);
-
-			for(i = 0; i < nelem(htlock); i++)
-				wlock(&htlock[i]);
-			lock(&disklock);
+			for(i = 0; i < nlistenthreads; i++)
+				pthread_cancel(listenthreads[i]);
+
+			for(i = 0; i < nshards; i++)
+				for(j = 0; j < nelem(shards[i].index.locks); j++)
+					wlock(&shards[i].index.locks[j]);
 			pthread_cancel(syncprocthread);
-			fsync(datafd);
-			fsync(indexfd);
+			safe_sync();
 			syslog_r(LOG_NOTICE, &sdata, "data and index flushed, exiting...");
 			exit(0);
 			break;
@@ -1124,14 +2403,88 @@ signalproc(void *p)
 }
 
 
+/* a path starting with @ is in the abstract namespace on linux */
+static socklen_t
+unixaddr(struct sockaddr_un *sun, char *path)
+{
+	socklen_t len;
+
+	memset(sun, 0, sizeof sun[0]);
+	sun->sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof sun->sun_path)
+		errxsyslog(1, "unix socket path too long: %s", path);
+	strcpy(sun->sun_path, path);
+	len = offsetof(struct sockaddr_un, sun_path)+strlen(path)+1;
+	if(path[0] == '@') {
+#ifdef __linux__
+		sun->sun_path[0] = '\0';
+		len--;
+#else
+		errxsyslog(1, "abstract unix sockets only supported on linux: %s", path);
+#endif
+	}
+	return len;
+}
+
+
+/* a stale socket left at path is removed first */
+static int
+bindunix(int *fds, int fdi, Netaddr *netaddr, int nacceptors)
+{
+	struct sockaddr_un sun;
+	struct stat st;
+	socklen_t len;
+	int fd, i;
+	char *path;
+
+	path = netaddr->path;
+	len = unixaddr(&sun, path);
+	if(path[0] != '@' && lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) && unlink(path) != 0)
+		errsyslog(1, "removing old unix socket %s", path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0)
+		errsyslog(1, "socket");
+	if(bind(fd, (struct sockaddr *)&sun, len) != 0)
+		errsyslog(1, "bind %s", path);
+	if(path[0] != '@' && netaddr->mode >= 0 && chmod(path, netaddr->mode) != 0)
+		errsyslog(1, "chmod %s", path);
+	if(listen(fd, backlog) != 0)
+		errsyslog(1, "listen");
+
+	/* the acceptors share the socket */
+	for(i = 0; i < nacceptors; i++) {
+		if(fdi >= Socketmax)
+			errxsyslog(1, "too many sockets");
+		fds[fdi++] = fd;
+	}
+	return nacceptors;
+}
+
+
 int
 dobind(int *fds, int fdi, Netaddr *netaddr)
 {
 	int gaierr;
 	struct addrinfo *addrs0, *addrs;
 	struct addrinfo localhints;
-	int n;
+	int n, i;
 	int fd;
+	int nsockets;
+	int one;
+
+	/*
+	 * on linux each acceptor gets its own socket, the kernel spreads
+	 * new connections over them.  elsewhere the acceptors share one.
+	 */
+	nsockets = 1;
+#ifdef __linux__
+	nsockets = nacceptors;
+#endif
+	one = 1;
+
+	if(netaddr->path != nil)
+		return bindunix(fds, fdi, netaddr, nsockets);
 
 	memset(&localhints, 0, sizeof localhints);
 	localhints.ai_family = PF_UNSPEC;
@@ -1145,19 +2498,31 @@ dobind(int *fds, int fdi, Netaddr *netaddr)
 
 	n = 0;
 	for(; addrs != nil; addrs = addrs->ai_next) {
-		fd = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
-		if(fd < 0)
-			errsyslog(1, "socket");
-
-		if(bind(fd, addrs->ai_addr, addrs->ai_addrlen) != 0)
-			errsyslog(1, "bind");
-
-		if(listen(fd, 5) != 0)
-			errsyslog(1, "listen");
-		if(fdi >= Listenmax)
-			errsyslog(1, "too many sockets");
-		fds[fdi++] = fd;
-		n += 1;
+		for(i = 0; i < nsockets; i++) {
+			fd = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
+			if(fd < 0)
+				errsyslog(1, "socket");
+
+#ifdef __linux__
+			if(nsockets > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) != 0)
+				errsyslog(1, "setsockopt SO_REUSEPORT");
+#endif
+			/* set before listen, accepted connections inherit them */
+			if(sockbufsize > 0
+				&& (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sockbufsize, sizeof sockbufsize) != 0
+				|| setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sockbufsize, sizeof sockbufsize) != 0))
+				errsyslog(1, "setsockopt socket buffer size");
+
+			if(bind(fd, addrs->ai_addr, addrs->ai_addrlen) != 0)
+				errsyslog(1, "bind");
+
+			if(listen(fd, backlog) != 0)
+				errsyslog(1, "listen");
+			if(fdi >= Socketmax)
+				errxsyslog(1, "too many sockets");
+			fds[fdi++] = fd;
+			n += 1;
+		}
 	}
 	freeaddrinfo(addrs0);
 	return n;
@@ -1165,11 +2530,15 @@ dobind(int *fds, int fdi, Netaddr *netaddr)
 
 
 void
-startlisten(pthread_t *thread, int listenfd,  int allowwrite)
+startlisten(int listenfd,  int allowwrite)
 {
 	Args *args;
 	pthread_attr_t attrs;
+	pthread_t *thread;
 
+	if(nlistenthreads >= Socketmax)
+		errxsyslog(1, "too many acceptors");
+	thread = &listenthreads[nlistenthreads++];
 	args = emalloc(sizeof args[0]);
 	args->fd = listenfd;
 	args->allowwrite = allowwrite;
@@ -1182,10 +2551,213 @@ startlisten(pthread_t *thread, int listenfd,  int allowwrite)
 }
 
 
+/* host!port, or unix!path!mode with optional octal mode */
+static void
+parseaddr(Netaddr *netaddr, char *s)
+{
+	char *p, *e;
+
+	netaddr->path = nil;
+	netaddr->mode = -1;
+	if(strncmp(s, "unix!", 5) == 0) {
+		netaddr->path = s+5;
+		p = strrchr(netaddr->path, '!');
+		if(p != nil) {
+			*p++ = '\0';
+			netaddr->mode = strtol(p, &e, 8);
+			if(*p == '\0' || *e != '\0' || netaddr->mode < 0 || netaddr->mode > 0777)
+				errxsyslog(1, "invalid unix socket mode %s", p);
+		}
+		if(netaddr->path[0] == '\0')
+			errxsyslog(1, "empty unix socket path");
+		return;
+	}
+	netaddr->port = strrchr(s, '!');
+	if(netaddr->port != nil)
+		*netaddr->port++ = '\0';
+	else
+		netaddr->port = defaultport;
+	netaddr->host = s;
+}
+
+
+/* store a block received from the primary, as a write */
+static int
+followstore(Vmsg *m, uchar *databuf)
+{
+	DHeader dh;
+	Vmsg w, out;
+	char *err;
+
+	err = unpackdheader(m->data, &dh);
+	if(err == nil && dh.size != m->dsize-Diskdheadersize)
+		err = "block size does not match header";
+	if(err == nil) {
+		w.op = Twrite;
+		w.tag = m->tag;
+		w.type = dh.type;
+		w.dsize = dh.size;
+		w.data = m->data+Diskdheadersize;
+		out.op = Rwrite;
+		out.data = nil;
+		handlewrite(&w, &out, databuf, 1);
+		if(out.op == Rerror)
+			err = out.msg;
+		else if(memcmp(out.score, dh.score, Scoresize) != 0)
+			err = "score of block invalid";
+	}
+	if(err != nil) {
+		syslog_r(LOG_ALERT, &sdata, "followstore: block before offset=%llu of primary: %s", m->addr, err);
+		return 0;
+	}
+	return 1;
+}
+
+
+/*
+ * follow the primary until the connection fails.  the position is
+ * acknowledged when all blocks received so far are stored.
+ */
+static void
+followsession(Conn *c, uchar *databuf)
+{
+	char handshake[] = "venti-02-memventi\n";
+	char buf[128];
+	uvlong pos, acked;
+	Vmsg m;
+	char *l;
+
+	l = connline(c, buf, sizeof buf);
+	if(l == nil || !compatible(l)) {
+		syslog_r(LOG_WARNING, &sdata, "followproc: error reading protocol handshake of primary or wrong protocol version");
+		return;
+	}
+	if(write(c->fd, handshake, strlen(handshake)) != strlen(handshake))
+		return;
+	m.op = Thello;
+	m.tag = 0;
+	if(writevmsg(c, &m) == 0 || connflush(c) == 0 || readvmsg(c, &m) == 0)
+		return;
+	if(m.op != Rhello || !m.ext) {
+		syslog_r(LOG_WARNING, &sdata, "followproc: primary does not support replication");
+		return;
+	}
+
+	lock(&followlock);
+	pos = followpos;
+	unlock(&followlock);
+	m.op = Tfollow;
+	m.tag = 0;
+	m.addr = pos;
+	if(writevmsg(c, &m) == 0 || connflush(c) == 0)
+		return;
+	syslog_r(LOG_NOTICE, &sdata, "followproc: following primary from offset=%llu", pos);
+
+	acked = pos;
+	for(;;) {
+		if(!connpending(c) && pos != acked) {
+			m.op = Tack;
+			m.tag = 0;
+			m.addr = pos;
+			if(writevmsg(c, &m) == 0 || connflush(c) == 0)
+				break;
+			acked = pos;
+		}
+		if(readvmsg(c, &m) == 0) {
+			syslog_r(LOG_WARNING, &sdata, "followproc: connection to primary lost at offset=%llu", pos);
+			break;
+		}
+		if(m.op == Rerror) {
+			syslog_r(LOG_WARNING, &sdata, "followproc: primary: %s", m.msg);
+			break;
+		}
+		if(m.op != Rfollow) {
+			syslog_r(LOG_WARNING, &sdata, "followproc: unexpected op %d from primary", m.op);
+			break;
+		}
+		if(!followstore(&m, databuf))
+			break;
+		pos = m.addr;
+		lock(&followlock);
+		followpos = pos;
+		unlock(&followlock);
+	}
+}
+
+
+/* connect to an address from parseaddr */
+static int
+dial(Netaddr *netaddr)
+{
+	struct addrinfo hints, *addrs0, *addrs;
+	struct sockaddr_un sun;
+	socklen_t len;
+	int fd, gaierr;
+
+	if(netaddr->path != nil) {
+		len = unixaddr(&sun, netaddr->path);
+		fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+		if(fd >= 0 && connect(fd, (struct sockaddr *)&sun, len) != 0) {
+			close(fd);
+			fd = -1;
+		}
+		return fd;
+	}
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	gaierr = getaddrinfo(netaddr->host, netaddr->port, &hints, &addrs0);
+	if(gaierr) {
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	fd = -1;
+	for(addrs = addrs0; addrs != nil && fd < 0; addrs = addrs->ai_next) {
+		fd = socket(addrs->ai_family, addrs->ai_socktype|SOCK_CLOEXEC, addrs->ai_protocol);
+		if(fd >= 0 && connect(fd, addrs->ai_addr, addrs->ai_addrlen) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(addrs0);
+	return fd;
+}
+
+
+/* replicate the primary, reconnecting after errors */
+static void *
+followproc(void *p)
+{
+	Conn c;
+	uchar *databuf;
+	int fd, failed;
+
+	memset(&c, 0, sizeof c);
+	databuf = emalloc(Connbufsize);
+	failed = 0;
+	while(stateget() == Srunning) {
+		fd = dial(&primary);
+		if(fd < 0) {
+			if(failed++ == 0)
+				syslog_r(LOG_WARNING, &sdata, "followproc: connecting to primary: %s", strerror(errno));
+		} else {
+			failed = 0;
+			conninit(&c, fd, databuf, Connbufsize);
+			followsession(&c, databuf);
+			close(fd);
+		}
+		sleep(Followretry);
+	}
+	syslog_r(LOG_WARNING, &sdata, "followproc: no longer following primary");
+	return nil;
+}
+
+
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: memventi [-fvD] [-r host!port] [-w host!port] [-i indexfile] [-d datafile] headscorewidth entryscorewidth addrwidth\n");
+	fprintf(stderr, "usage: memventi [-fmntvyDHN] [-r host!port] [-w host!port] [-F host!port] [-i indexfile] [-c coldfile] [-d datafile ...] [-s segmentsize] [-S nshards] [-a alignment] [-I importfile] [-R nrecent] [-j nproc] [-A nacceptors] [-b backlog] [-B bufsize] headscorewidth entryscorewidth addrwidth\n");
 	exit(1);
 }
 
@@ -1193,58 +2765,123 @@ usage(void)
 int
 main(int argc, char *argv[])
 {
-	int ch;
+	int ch, align;
 	sigset_t mask;
 	Netaddr readaddrs[Listenmax];
 	Netaddr writeaddrs[Listenmax];
-	Netaddr *netaddr;
-	int readfds[Listenmax];
-	int writefds[Listenmax];
-	int i;
+	int readfds[Socketmax];
+	int writefds[Socketmax];
+	int i, j, n;
 	pthread_attr_t attrs;
+	pthread_t thread;
+	struct sockaddr_un sun;
+	char *errmsg;
 
 	fflag = 0;
 	vflag = 0;
 	nreadaddrs = nwriteaddrs = 0;
-	while((ch = getopt(argc, argv, "Dfvd:i:r:w:")) != -1) {
+	importnproc = sysconf(_SC_NPROCESSORS_ONLN);
+	while((ch = getopt(argc, argv, "DHNfmntvyA:B:F:a:b:c:I:R:S:d:i:j:r:s:w:")) != -1) {
 		switch(ch) {
+		case 'a':
+			align = atoi(optarg);
+			if(align <= 0 || align > 1<<Alignshiftmax || (align & (align-1)) != 0)
+				errxsyslog(1, "invalid alignment %s, must be a power of two up to %d", optarg, 1<<Alignshiftmax);
+			for(alignflag = 0; (1<<alignflag) != align; alignflag++)
+				;
+			break;
+		case 'c':
+			coldfile = optarg;
+			break;
 		case 'D':
 			debugflag = 1;
 			break;
 		case 'd':
-			datafile = optarg;
+			if(ndatafiles == nelem(datafiles))
+				errxsyslog(1, "too many datafiles specified");
+			datafiles[ndatafiles++] = optarg;
+			break;
+		case 'F':
+			following = 1;
+			parseaddr(&primary, optarg);
+			if(primary.path != nil)
+				unixaddr(&sun, primary.path);
 			break;
 		case 'f':
 			fflag = 1;
 			break;
+		case 'H':
+			lockedflags |= Lockedhuge;
+			break;
+		case 'm':
+			mflag = 1;
+			break;
+		case 'N':
+			lockedflags |= Lockedinterleave;
+			break;
+		case 't':
+			tflag = 1;
+			break;
+		case 'I':
+			if(nimportfiles == nelem(importfiles))
+				errxsyslog(1, "too many import files specified");
+			importfiles[nimportfiles++] = optarg;
+			break;
 		case 'i':
 			indexfile = optarg;
 			break;
+		case 'R':
+			nrecent = strtoul(optarg, nil, 10);
+			break;
+		case 'j':
+			importnproc = atoi(optarg);
+			if(importnproc <= 0)
+				usage();
+			break;
+		case 'A':
+			nacceptors = atoi(optarg);
+			if(nacceptors <= 0)
+				usage();
+			break;
+		case 'b':
+			backlog = atoi(optarg);
+			if(backlog <= 0)
+				usage();
+			break;
+		case 'B':
+			sockbufsize = atoi(optarg);
+			if(sockbufsize <= 0)
+				usage();
+			break;
+		case 'n':
+			nodelay = 1;
+			break;
 		case 'r':
 			if(nreadaddrs == nelem(readaddrs))
 				errxsyslog(1, "too many read-only hosts specified");
-			netaddr = &readaddrs[nreadaddrs++];
-			netaddr->port = strrchr(optarg, '!');
-			if(netaddr->port != nil)
-				*netaddr->port++ = '\0';
-			else
-				netaddr->port = defaultport;
-			netaddr->host = optarg;
+			parseaddr(&readaddrs[nreadaddrs++], optarg);
 			break;
 		case 'w':
 			if(nwriteaddrs == nelem(writeaddrs))
 				errxsyslog(1, "too many read/write hosts specified");
-			netaddr = &writeaddrs[nwriteaddrs++];
-			netaddr->port = strrchr(optarg, '!');
-			if(netaddr->port != nil)
-				*netaddr->port++ = '\0';
-			else
-				netaddr->port = defaultport;
-			netaddr->host = optarg;
+			parseaddr(&writeaddrs[nwriteaddrs++], optarg);
+			break;
+		case 's':
+			segshift = parsesegsize(optarg);
+			if(segshift < 0)
+				errxsyslog(1, "invalid segment size %s", optarg);
+			break;
+		case 'S':
+			nshardsflag = atoi(optarg);
+			if(nshardsflag <= 0 || nshardsflag > Shardmax || (nshardsflag & (nshardsflag-1)) != 0)
+				errxsyslog(1, "invalid shard count %s, must be a power of two up to %d", optarg, Shardmax);
 			break;
 		case 'v':
 			vflag = 1;
 			break;
+		case 'y':
+			yflag = 1;
+			break;
 		default:
 			usage();
 		}
@@ -1254,6 +2891,9 @@ main(int argc, char *argv[])
 
 	if(argc != 3)
 		usage();
+	if(ndatafiles == 0)
+		datafiles[ndatafiles++] = "data";
+	datafile = datafiles[0];
 
 	headscorewidth = atoi(argv[0]);
 	entryscorewidth = atoi(argv[1]);
@@ -1262,17 +2902,23 @@ main(int argc, char *argv[])
 		usage();
 	if(headscorewidth + entryscorewidth > Indexscoresize*8)
 		errxsyslog(1, "too many bits in head and per entry, maximum is %d", Indexscoresize*8);
-	endaddr = (1ULL<<addrwidth)-1;
-	mementrysize = 8+entryscorewidth+addrwidth;
-
 	if(nreadaddrs == 0 && nwriteaddrs == 0) {
 		writeaddrs[0].host = "localhost";
 		writeaddrs[0].port = defaultport;
+		writeaddrs[0].path = nil;
 		nwriteaddrs++;
 	}
 
-	openlog_r("memventi", LOG_CONS|(fflag ? LOG_PERROR : 0), LOG_DAEMON, &sdata);
+	openlog_r("memventi", LOG_CONS|(fflag || nimportfiles > 0 ? LOG_PERROR : 0), LOG_DAEMON, &sdata);
 	setlogmask(LOG_UPTO(vflag ? LOG_DEBUG : LOG_NOTICE));
+	if(tflag && (following || nimportfiles > 0))
+		errxsyslog(1, "cannot follow or import with a datafile written by another process");
+
+	if(nimportfiles > 0) {
+		init();
+		import();
+		exit(0);
+	}
 
 	nreadlistens = nwritelistens = 0;
 	for(i = 0; i < nreadaddrs; i++)
@@ -1286,16 +2932,53 @@ main(int argc, char *argv[])
 		errsyslog(1, "pthread_sigmask");
 
 	init();
+	poolinit(&connpool, "conn", sizeof (Args), Connpoolmax, releaseargs);
+	poolinit(&datapool, "data", Datamax, Datapoolmax, nil);
+	startwriters();
+	startcompactors();
 	stateset(Srunning);
+	if(following) {
+		snprintf(followfile, sizeof followfile, "%s.follow", indexfile);
+		errmsg = followread(followfile, &followpos);
+		if(errmsg != nil)
+			errxsyslog(1, "%s", errmsg);
+	}
 
 	if(!fflag)
 		if(daemon(1, debugflag ? 1 : 0) != 0)
 			errsyslog(1, "could not daemonize");
 
+	/* dobind made a socket per acceptor when it could */
+	n = nacceptors;
+#ifdef __linux__
+	n = 1;
+#endif
 	for(i = 0; i < nreadlistens; i++)
-		startlisten(&readlistenthread[i], readfds[i], 0);
+		for(j = 0; j < n; j++)
+			startlisten(readfds[i], 0);
+	/* a follower only serves reads */
 	for(i = 0; i < nwritelistens; i++)
-		startlisten(&writelistenthread[i], writefds[i], 1);
+		for(j = 0; j < n; j++)
+			startlisten(writefds[i], !following && !tflag);
+
+	if(following) {
+		if(pthread_attr_init(&attrs) != 0
+			|| pthread_attr_setstacksize(&attrs, Stacksize) != 0
+			|| pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_DETACHED) != 0)
+			errsyslog(1, "error setting stacksize for followproc");
+		if(pthread_create(&thread, &attrs, followproc, nil) != 0)
+			errsyslog(1, "error creating followproc");
+		pthread_attr_destroy(&attrs);
+	}
+	if(tflag) {
+		if(pthread_attr_init(&attrs) != 0
+			|| pthread_attr_setstacksize(&attrs, Stacksize) != 0
+			|| pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_DETACHED) != 0)
+			errsyslog(1, "error setting stacksize for tailproc");
+		if(pthread_create(&thread, &attrs, tailproc, nil) != 0)
+			errsyslog(1, "error creating tailproc");
+		pthread_attr_destroy(&attrs);
+	}
 
 	if(pthread_attr_init(&attrs) != 0
 		|| pthread_attr_setstacksize(&attrs, Stacksize) != 0)
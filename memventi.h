@@ -1,18 +1,26 @@
 #define _FILE_OFFSET_BITS 64	/* sigh, for gnu libc */
 #define _BSD_SOURCE
+#define _GNU_SOURCE	/* accept4 */
 #define _XOPEN_SOURCE 600
 
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <assert.h>
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
@@ -27,6 +35,11 @@
 
 #include <openssl/sha.h>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
 /* openbsd defines these in sys/param.h */
 #undef roundup
 #undef MAX
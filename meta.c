@@ -0,0 +1,141 @@
+#include "memventi.h"
+
+/*
+ * the metadata file records the properties of a memventi that are fixed
+ * when it is created, one "name value" pair per line.  a memventi
+ * without metadata file has a single shard and unaligned blocks.
+ */
+
+
+char *
+metaread(char *file, Meta *m)
+{
+	static char errmsg[256];
+	char line[128];
+	char name[32];
+	long v;
+	FILE *f;
+
+	m->present = 0;
+	m->nshards = 1;
+	m->alignshift = 0;
+	f = fopen(file, "r");
+	if(f == nil) {
+		if(errno == ENOENT)
+			return nil;
+		snprintf(errmsg, sizeof errmsg, "opening metadata file %s: %s", file, strerror(errno));
+		return errmsg;
+	}
+	while(fgets(line, sizeof line, f) != nil) {
+		if(sscanf(line, "%31s %ld", name, &v) != 2) {
+			snprintf(errmsg, sizeof errmsg, "metadata file %s: bad line", file);
+			goto error;
+		}
+		if(strcmp(name, "shards") == 0 && v > 0 && v <= Shardmax && (v & (v-1)) == 0)
+			m->nshards = v;
+		else if(strcmp(name, "align") == 0 && v > 0 && v <= 1<<Alignshiftmax && (v & (v-1)) == 0)
+			for(m->alignshift = 0; (1<<m->alignshift) != v; m->alignshift++)
+				;
+		else {
+			snprintf(errmsg, sizeof errmsg, "metadata file %s: bad value for %s", file, name);
+			goto error;
+		}
+	}
+	if(ferror(f)) {
+		snprintf(errmsg, sizeof errmsg, "reading metadata file %s: %s", file, strerror(errno));
+		goto error;
+	}
+	fclose(f);
+	m->present = 1;
+	return nil;
+
+error:
+	fclose(f);
+	return errmsg;
+}
+
+
+/* replace file by a temporary file, so it is never partially written */
+static char *
+replace(char *file, char *what, char *contents)
+{
+	static char errmsg[PATH_MAX+128];
+	char tmp[PATH_MAX];
+	FILE *f;
+
+	snprintf(tmp, sizeof tmp, "%s.new", file);
+	f = fopen(tmp, "w");
+	if(f == nil) {
+		snprintf(errmsg, sizeof errmsg, "creating %s file %s: %s", what, tmp, strerror(errno));
+		return errmsg;
+	}
+	fputs(contents, f);
+	if(fflush(f) != 0 || fsync(fileno(f)) != 0) {
+		snprintf(errmsg, sizeof errmsg, "writing %s file %s: %s", what, tmp, strerror(errno));
+		fclose(f);
+		unlink(tmp);
+		return errmsg;
+	}
+	fclose(f);
+	if(rename(tmp, file) != 0) {
+		snprintf(errmsg, sizeof errmsg, "renaming %s to %s: %s", tmp, file, strerror(errno));
+		unlink(tmp);
+		return errmsg;
+	}
+	return nil;
+}
+
+
+char *
+metawrite(char *file, Meta *m)
+{
+	char buf[128];
+	char *errmsg;
+
+	snprintf(buf, sizeof buf, "shards %d\nalign %d\n", m->nshards, 1<<m->alignshift);
+	errmsg = replace(file, "metadata", buf);
+	if(errmsg != nil)
+		return errmsg;
+	m->present = 1;
+	return nil;
+}
+
+
+/*
+ * a follower records the address in the datafile of its primary up to
+ * which it has stored the blocks, as "position addr".  without file it
+ * starts at the beginning.
+ */
+char *
+followread(char *file, uvlong *posp)
+{
+	static char errmsg[PATH_MAX+128];
+	char line[128];
+	FILE *f;
+
+	*posp = 0;
+	f = fopen(file, "r");
+	if(f == nil) {
+		if(errno == ENOENT)
+			return nil;
+		snprintf(errmsg, sizeof errmsg, "opening follow file %s: %s", file, strerror(errno));
+		return errmsg;
+	}
+	if(fgets(line, sizeof line, f) == nil || sscanf(line, "position %llu", posp) != 1) {
+		snprintf(errmsg, sizeof errmsg, "follow file %s: bad line", file);
+		fclose(f);
+		return errmsg;
+	}
+	fclose(f);
+	return nil;
+}
+
+
+char *
+followwrite(char *file, uvlong pos)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof buf, "position %llu\n", pos);
+	return replace(file, "follow", buf);
+}
@@ -26,7 +26,7 @@ readstr(uchar **bufp, uchar *end, uchar *s, int slen)
 }
 
 static int
-readmem(uchar **bufp, uchar *end)
+readmem(uchar **bufp, uchar *end, uchar **memp, int *lenp)
 {
 	ushort len;
 	uchar *buf;
@@ -39,6 +39,8 @@ readmem(uchar **bufp, uchar *end)
 	buf += 1;
 	if(buf+len > end)
 		return 0;
+	*memp = buf;
+	*lenp = len;
 	buf += len;
 	*bufp = buf;
 	return 1;
@@ -50,7 +52,7 @@ writestr(uchar *p, char *s, int *lenp)
 {
 	int slen;
 
-	slen = strlen(s);
+	slen = MIN(strlen(s), Stringmax);
 	PUT16(p, slen);
 	p += 2;
 	memcpy(p, s, slen);
@@ -59,33 +61,130 @@ writestr(uchar *p, char *s, int *lenp)
 }
 
 
+/*
+ * connections read into a receive buffer large enough for any message,
+ * messages are parsed in place and the data of Twrite is left in the
+ * buffer until the next message is read.  replies are gathered and
+ * written in one writev by connflush, the caller flushes before it
+ * waits for more requests.  the buffers of a zeroed or reused Conn are
+ * kept until connfree.
+ */
+void
+conninit(Conn *c, int fd, uchar *scratch, ulong nscratch)
+{
+	c->fd = fd;
+	if(c->rbuf == nil)
+		c->rbuf = emalloc(Connrbufsize);
+	c->rp = c->rn = 0;
+	if(c->wbuf == nil)
+		c->wbuf = emalloc(Connwbufsize);
+	c->wn = 0;
+	c->niov = 0;
+	c->scratch = scratch;
+	c->nscratch = nscratch;
+}
+
+
+void
+connfree(Conn *c)
+{
+	free(c->rbuf);
+	free(c->wbuf);
+	c->rbuf = c->wbuf = nil;
+}
+
+
+/* make n bytes available at rbuf+rp */
+static int
+fill(Conn *c, ulong n)
+{
+	ssize_t r;
+
+	if(c->rp == c->rn)
+		c->rp = c->rn = 0;
+	if(c->rp+n > Connrbufsize) {
+		memmove(c->rbuf, c->rbuf+c->rp, c->rn-c->rp);
+		c->rn -= c->rp;
+		c->rp = 0;
+	}
+	while(c->rn-c->rp < n) {
+		r = read(c->fd, c->rbuf+c->rn, Connrbufsize-c->rn);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			return 0;
+		c->rn += r;
+	}
+	return 1;
+}
+
+
+/* whether a whole message has been received and not yet read */
 int
-readvmsg(FILE *f, Vmsg *m, uchar *buf)
+connpending(Conn *c)
 {
-	uchar *p;
+	ulong n;
+
+	n = c->rn-c->rp;
+	return n >= 2 && n >= 2+GET16(c->rbuf+c->rp);
+}
+
+
+/* like fgets */
+char *
+connline(Conn *c, char *buf, int n)
+{
+	uchar *e;
+	ulong len;
+
+	for(;;) {
+		e = memchr(c->rbuf+c->rp, '\n', c->rn-c->rp);
+		if(e != nil || c->rn-c->rp >= n-1)
+			break;
+		if(!fill(c, c->rn-c->rp+1))
+			return nil;
+	}
+	len = n-1;
+	if(e != nil)
+		len = MIN(len, e+1-(c->rbuf+c->rp));
+	memcpy(buf, c->rbuf+c->rp, len);
+	buf[len] = '\0';
+	c->rp += len;
+	return buf;
+}
+
+
+int
+readvmsg(Conn *c, Vmsg *m)
+{
+	uchar *p, *mem;
 	uchar *end;
+	int i, len;
 
 	debug(LOG_DEBUG, "readvmsg: starting read");
-	if(fread(buf, 1, 2, f) != 2)
+	if(!fill(c, 2))
 		return 0;
-	m->msize = GET16(buf);
-	if(m->msize >= 8+Datamax)
+	m->msize = GET16(c->rbuf+c->rp);
+	if(m->msize > Followmsgmax)
 		return 0;
 
 	debug(LOG_DEBUG, "readvmsg: incoming message of %u bytes", (uint)m->msize);
 
-	if(fread(buf, 1, m->msize, f) != m->msize)
+	if(!fill(c, 2+m->msize))
 		return 0;
+	p = c->rbuf+c->rp+2;
+	c->rp += 2+m->msize;
 	if(m->msize < 2)
 		return 0;
-	end = buf + m->msize;
+	end = p + m->msize;
 	debug(LOG_DEBUG, "readvmsg: incoming message read");
 
-	p = buf;
 	m->op = GET8(p);
 	p += 1;
 	m->tag = GET8(p);
 	p += 1;
+	if(m->op != Rfollow && m->msize >= 8+Datamax)
+		return 0;
 
 	m->data = nil;
 	switch(m->op) {
@@ -98,10 +197,11 @@ readvmsg(FILE *f, Vmsg *m, uchar *buf)
 			return 0;
 		p += 1;
 
-		if(readmem(&p, end) == 0)	/* crypto */
+		if(readmem(&p, end, &mem, &len) == 0)	/* crypto */
 			return 0;
-		if(readmem(&p, end) == 0)	/* codec */
+		if(readmem(&p, end, &mem, &len) == 0)	/* codec */
 			return 0;
+		m->ext = memchr(mem, Codecbatch, len) != nil;
 		break;
 	case Tread:
 		if(p+Scoresize+1+1+2 != end)
@@ -121,17 +221,78 @@ readvmsg(FILE *f, Vmsg *m, uchar *buf)
 		p += 1;
 		p += 3;
 		m->dsize = m->msize - 6;
-		m->data = trymalloc(m->dsize);
-		if(m->data == nil) {
-			debug(LOG_DEBUG, "readvmsg: out of memory for write of %u bytes", (uint)m->dsize);
+		m->data = p;
+		break;
+	case Tmread:
+		if(p+2 > end)
+			return 0;
+		m->nbatch = GET16(p);
+		p += 2;
+		if(m->nbatch == 0 || p+m->nbatch*Mreadsize != end)
+			return 0;
+		m->data = p;
+		break;
+	case Tmhave:
+		if(p+2 > end)
+			return 0;
+		m->nbatch = GET16(p);
+		p += 2;
+		if(m->nbatch == 0 || p+m->nbatch*Mhavesize != end)
 			return 0;
+		m->data = p;
+		break;
+	case Tmwrite:
+		if(p+2 > end)
+			return 0;
+		m->nbatch = GET16(p);
+		p += 2;
+		m->data = p;
+		for(i = 0; i < m->nbatch; i++) {
+			if(p+Mwritesize > end || p+Mwritesize+GET16(p+2) > end)
+				return 0;
+			p += Mwritesize+GET16(p+2);
 		}
-		memcpy(m->data, p, m->dsize);
+		if(m->nbatch == 0 || p != end)
+			return 0;
+		m->dsize = end-m->data;
+		break;
+	case Tfollow:
+	case Tack:
+		if(p+8 != end)
+			return 0;
+		m->addr = GET64(p);
 		break;
 	case Tping:
 	case Tsync:
 	case Tgoodbye:
 		break;
+
+	/* replies, read by a follower */
+	case Rhello:
+		if(readstr(&p, end, nil, 0) == 0)	/* sid */
+			return 0;
+		if(p+2 > end)
+			return 0;
+		p += 1;	/* rcrypto */
+		m->ext = GET8(p) == Codecbatch;
+		break;
+	case Rfollow:
+		if(p+8+Diskdheadersize > end)
+			return 0;
+		m->addr = GET64(p);
+		p += 8;
+		m->data = p;
+		m->dsize = end-p;
+		break;
+	case Rerror:
+		if(p+2 > end || p+2+GET16(p) > end)
+			return 0;
+		/* nul-terminated in place of its length */
+		len = GET16(p);
+		memmove(p, p+2, len);
+		p[len] = '\0';
+		m->msg = (char *)p;
+		break;
 	default:
 		return 0;
 	}
@@ -139,31 +300,168 @@ readvmsg(FILE *f, Vmsg *m, uchar *buf)
 }
 
 
-int
-writevmsg(int fd, Vmsg *m, uchar *buf)
+/* the i'th read of Tmread m, as Tread */
+void
+mreadentry(Vmsg *m, int i, Vmsg *r)
+{
+	uchar *p;
+
+	p = m->data+i*Mreadsize;
+	r->op = Tread;
+	r->tag = m->tag;
+	memcpy(r->score, p, Scoresize);
+	p += Scoresize;
+	r->type = GET8(p);
+	p += 1;
+	p += 1;
+	r->count = GET16(p);
+	r->data = nil;
+}
+
+
+/* the i'th score of Tmhave m, as Tread */
+void
+mhaveentry(Vmsg *m, int i, Vmsg *r)
 {
 	uchar *p;
-	int len;
-	int r, n;
 
-	p = buf+4;
+	p = m->data+i*Mhavesize;
+	r->op = Tread;
+	r->tag = m->tag;
+	memcpy(r->score, p, Scoresize);
+	p += Scoresize;
+	r->type = GET8(p);
+	r->count = 0;
+	r->data = nil;
+}
+
+
+/* the write of Tmwrite at p, as Twrite.  returns the next write */
+uchar *
+mwriteentry(uchar *p, Vmsg *w)
+{
+	w->op = Twrite;
+	w->type = GET8(p);
+	p += 1;
+	p += 1;
+	w->dsize = GET16(p);
+	p += 2;
+	w->data = p;
+	return p+w->dsize;
+}
+
+
+static void
+queue(Conn *c, uchar *p, ulong n)
+{
+	struct iovec *v;
+
+	if(c->niov > 0) {
+		v = &c->iov[c->niov-1];
+		if((uchar *)v->iov_base+v->iov_len == p) {
+			v->iov_len += n;
+			return;
+		}
+	}
+	v = &c->iov[c->niov++];
+	v->iov_base = p;
+	v->iov_len = n;
+}
+
+
+int
+connflush(Conn *c)
+{
+	ssize_t n, r;
+	int i;
+
+	if(c->niov == 0)
+		return 1;
+	n = 0;
+	for(i = 0; i < c->niov; i++)
+		n += c->iov[i].iov_len;
+	debug(LOG_DEBUG, "connflush: writing %d replies of %zd bytes", c->niov, n);
+	r = writevn(c->fd, c->iov, c->niov);
+	c->niov = 0;
+	c->wn = 0;
+	if(r != n) {
+		debug(LOG_DEBUG, "writevn: wrote %zd instead of %zd", r, n);
+		return 0;
+	}
+	return 1;
+}
+
+
+/*
+ * the reply is assembled in the reply buffer, except for the data of
+ * Rread and Rfollow.  that is queued from m->data directly, or copied when small
+ * and in the scratch buffer.  larger data from the scratch buffer is
+ * written before returning.
+ */
+int
+writevmsg(Conn *c, Vmsg *m)
+{
+	uchar *h, *p;
+	int len, hasdata;
+
+	if(Connwbufsize-c->wn < Replymax+Conncopymax || c->niov+2 > Conniovmax)
+		if(!connflush(c))
+			return 0;
+
+	h = c->wbuf+c->wn;
+	p = h+4;
 	switch(m->op) {
+	case Thello:
+		writestr(p, "02", &len);
+		p += len;
+		writestr(p, "anonymous", &len);
+		p += len;
+		PUT8(p, 0);	/* strength */
+		p += 1;
+		PUT8(p, 0);	/* crypto */
+		p += 1;
+		PUT8(p, 1);	/* codec */
+		p += 1;
+		PUT8(p, Codecbatch);
+		p += 1;
+
+		m->msize = p-(h+2);
+		break;
+	case Tfollow:
+	case Tack:
+		PUT64(p, m->addr);
+		p += 8;
+
+		m->msize = 2+8;
+		break;
+	case Rfollow:
+		PUT64(p, m->addr);
+		p += 8;
+
+		m->msize = 2+8+m->dsize;
+		break;
 	case Rhello:
 		writestr(p, "anonymous", &len);
 		p += len;
 		PUT8(p, 0);
 		p += 1;
-		PUT8(p, 0);
+		PUT8(p, m->ext ? Codecbatch : 0);
 		p += 1;
 
 		m->msize = 2+len+2;
 		break;
 	case Rread:
-		memcpy(p, m->data, m->dsize);
-		p += m->dsize;
-
 		m->msize = 2+m->dsize;
 		break;
+	case Rmhave:
+		PUT16(p, m->nbatch);
+		p += 2;
+		len = (m->nbatch+7)/8;
+		memcpy(p, m->data, len);
+		p += len;
+
+		m->msize = 2+2+len;
+		break;
 	case Rwrite:
 		memcpy(p, m->score, Scoresize);
 		p += Scoresize;
@@ -186,7 +484,11 @@ writevmsg(int fd, Vmsg *m, uchar *buf)
 		return 0;
 	}
 
-	p = buf;
+	/* data of Rread and Rfollow is queued separately */
+	hasdata = m->op == Rread || m->op == Rfollow;
+	len = hasdata ? p-h : 2+m->msize;
+
+	p = h;
 	PUT16(p, m->msize);
 	p += 2;
 	PUT8(p, m->op);
@@ -194,14 +496,21 @@ writevmsg(int fd, Vmsg *m, uchar *buf)
 	PUT8(p, m->tag);
 	p += 1;
 
-
-	n = 2+m->msize;
-	debug(LOG_DEBUG, "writevmsg: writing op %d msize %d", m->op, n);
-	r = writen(fd, (char *)buf, n);
-	if(r != n) {
-		debug(LOG_DEBUG, "writen: wrote %d instead of %d", r, n);
-		return 0;
+	debug(LOG_DEBUG, "writevmsg: queueing op %d msize %d", m->op, 2+m->msize);
+	queue(c, h, len);
+	c->wn += len;
+	if(!hasdata || m->dsize == 0)
+		return 1;
+	if(m->data < c->scratch || m->data >= c->scratch+c->nscratch) {
+		queue(c, m->data, m->dsize);
+		return 1;
 	}
-
-	return 1;
+	if(m->dsize <= Conncopymax) {
+		memcpy(c->wbuf+c->wn, m->data, m->dsize);
+		queue(c, c->wbuf+c->wn, m->dsize);
+		c->wn += m->dsize;
+		return 1;
+	}
+	queue(c, m->data, m->dsize);
+	return connflush(c);
 }
@@ -0,0 +1,108 @@
+#include "memventi.h"
+
+/*
+ * a cache of the full scores of blocks recently written or found to be
+ * present, with their address.  a write of a block in the cache is a
+ * duplicate, it needs no disk read to compare the score in the block
+ * header and no write lock on the index.  blocks are never removed from
+ * the datafile, so entries never become invalid.
+ *
+ * the cache is set associative, the set is selected by the last 32 bits
+ * of the score, away from the leading bits that select the shard and
+ * head.  sets are kept in order of use, the least recently used entry
+ * of a set is replaced.
+ */
+
+
+static Recentry *
+recentset(Recent *r, uchar *score, Lock **lp)
+{
+	ulong s;
+
+	s = GET32(score+Scoresize-4) & (r->nsets-1);
+	*lp = &r->locks[s % Recentlocks];
+	return &r->sets[s*Recentways];
+}
+
+
+/* move entry i of set to the front */
+static void
+recentuse(Recentry *set, int i)
+{
+	Recentry e;
+
+	if(i == 0)
+		return;
+	e = set[i];
+	memmove(&set[1], &set[0], i * sizeof set[0]);
+	set[0] = e;
+}
+
+
+/* a cache of at least n entries, n 0 disables the cache */
+void
+recentinit(Recent *r, ulong n)
+{
+	ulong i;
+
+	for(r->nsets = 1; r->nsets*Recentways < n; r->nsets *= 2)
+		;
+	r->sets = nil;
+	if(n > 0)
+		r->sets = emalloc(r->nsets*Recentways * sizeof r->sets[0]);
+	for(i = 0; r->sets != nil && i < r->nsets*Recentways; i++)
+		r->sets[i].used = 0;
+	r->nhits = r->nmisses = 0;
+	for(i = 0; i < Recentlocks; i++)
+		if(!lockinit(&r->locks[i]))
+			errxsyslog(1, "init recent lock");
+}
+
+
+/* whether score with type is in the cache, its address is put in *addrp */
+int
+recentlookup(Recent *r, uchar *score, uchar type, uvlong *addrp)
+{
+	Recentry *set;
+	Lock *l;
+	int i;
+
+	if(r->sets == nil)
+		return 0;
+	set = recentset(r, score, &l);
+	lock(l);
+	for(i = 0; i < Recentways && set[i].used; i++)
+		if(set[i].type == type && memcmp(set[i].score, score, Scoresize) == 0) {
+			*addrp = set[i].addr;
+			recentuse(set, i);
+			__atomic_fetch_add(&r->nhits, 1, __ATOMIC_RELAXED);
+			unlock(l);
+			return 1;
+		}
+	__atomic_fetch_add(&r->nmisses, 1, __ATOMIC_RELAXED);
+	unlock(l);
+	return 0;
+}
+
+
+void
+recentadd(Recent *r, uchar *score, uchar type, uvlong addr)
+{
+	Recentry *set;
+	Lock *l;
+	int i;
+
+	if(r->sets == nil)
+		return;
+	set = recentset(r, score, &l);
+	lock(l);
+	for(i = 0; i < Recentways-1 && set[i].used; i++)
+		if(set[i].type == type && memcmp(set[i].score, score, Scoresize) == 0)
+			break;
+	memmove(set[i].score, score, Scoresize);
+	set[i].type = type;
+	set[i].addr = addr;
+	set[i].used = 1;
+	recentuse(set, i);
+	unlock(l);
+}
@@ -0,0 +1,259 @@
+#include "memventi.h"
+
+/*
+ * parallel sequential scan of (a range of) a datafile.  one proc reads
+ * the file in large chunks and splits them at block headers, nproc
+ * procs verify the scores of the blocks, and the calling proc is
+ * handed the blocks in datafile order through s->fn.  regions that do
+ * not start with a valid header are skipped up to the next header
+ * magic and handed to s->fn as a single block with err set.  zero
+ * bytes after a block, padding up to the alignment of the next block,
+ * are skipped.  s->prefetch, when set, is handed the blocks a few blocks
+ * ahead of s->fn.
+ */
+
+enum {
+	Scanahead	= 8,
+};
+
+enum {
+	Sfree,
+	Sread,
+	Sverified,
+};
+
+
+static Scanblock *
+addblock(Scan *s, Scanchunk *c, uvlong offset, ulong len, char *err)
+{
+	Scanblock *b;
+
+	if(c->nb == c->nballoc) {
+		c->nballoc = MAX(64, 2*c->nballoc);
+		c->b = erealloc(c->b, sizeof c->b[0] * c->nballoc);
+	}
+	b = &c->b[c->nb++];
+	b->offset = s->base+offset;
+	b->len = len;
+	b->data = nil;
+	b->err = err;
+	return b;
+}
+
+
+static ulong
+resync(uchar *buf, ulong p, ulong n, int last)
+{
+	for(; p+Diskdheadersize <= n; p++)
+		if(GET32(buf+p) == Headermagic && GET16(buf+p+Magicsize+Scoresize+1) <= Datamax)
+			return p;
+	if(last)
+		return n;
+	return MAX(p, n-(Diskdheadersize-1));
+}
+
+
+static int
+readchunk(Scan *s, Scanchunk *c, uvlong off, uvlong *nextp)
+{
+	ulong want, n, p, q, len;
+	int last;
+	DHeader dh;
+	Scanblock *b;
+	ssize_t r;
+
+	want = MIN(Scanchunksize, s->end-off);
+	r = preadn(s->fd, c->buf, want, off);
+	if(r < 0) {
+		snprintf(s->errbuf, sizeof s->errbuf, "reading datafile at offset=%llu: %s", off, strerror(errno));
+		return 0;
+	}
+	n = r;
+	last = n < want || off+n == s->end;
+
+	c->nb = 0;
+	p = 0;
+	while(p < n) {
+		if(c->buf[p] == 0) {
+			for(q = p; q < n && q-p < 1<<Alignshiftmax && c->buf[q] == 0; q++)
+				;
+			if(q-p < 1<<Alignshiftmax) {
+				if(q == n && !last) {
+					n = p;
+					break;
+				}
+				p = q;
+				continue;
+			}
+		}
+		if(n-p < Diskdheadersize) {
+			if(last)
+				addblock(s, c, off+p, n-p, "partial block header at end of file");
+			else
+				n = p;
+			break;
+		}
+		if(unpackdheader(c->buf+p, &dh) != nil) {
+			q = resync(c->buf, p+1, n, last);
+			addblock(s, c, off+p, q-p, "no valid block header");
+			p = q;
+			continue;
+		}
+		len = Diskdheadersize+dh.size;
+		if(len > n-p) {
+			if(last)
+				addblock(s, c, off+p, n-p, "partial block at end of file");
+			else
+				n = p;
+			break;
+		}
+		b = addblock(s, c, off+p, len, nil);
+		b->dh = dh;
+		b->data = c->buf+p+Diskdheadersize;
+		p += len;
+	}
+	*nextp = off+n;
+	if(last)
+		*nextp = s->end;
+	return 1;
+}
+
+
+static void *
+scanreader(void *p)
+{
+	Scan *s;
+	Scanchunk *c;
+	uvlong off, next;
+	int ok;
+
+	s = p;
+	off = s->start;
+	lock(&s->lock);
+	while(off < s->end) {
+		c = &s->chunks[s->nread % s->nchunks];
+		while(c->state != Sfree)
+			rsleep(&s->rendez);
+		unlock(&s->lock);
+		ok = readchunk(s, c, off, &next);
+		lock(&s->lock);
+		if(!ok) {
+			s->err = s->errbuf;
+			break;
+		}
+		c->state = Sread;
+		s->nread++;
+		off = next;
+		rwakeupall(&s->rendez);
+	}
+	s->eof = 1;
+	rwakeupall(&s->rendez);
+	unlock(&s->lock);
+	return nil;
+}
+
+
+static void *
+scanverifier(void *p)
+{
+	Scan *s;
+	Scanchunk *c;
+	Scanblock *b;
+	uchar score[Scoresize];
+	int i;
+
+	s = p;
+	lock(&s->lock);
+	for(;;) {
+		while(s->nverify == s->nread && !s->eof)
+			rsleep(&s->rendez);
+		if(s->nverify == s->nread)
+			break;
+		c = &s->chunks[s->nverify++ % s->nchunks];
+		unlock(&s->lock);
+		for(i = 0; i < c->nb; i++) {
+			b = &c->b[i];
+			if(b->err != nil)
+				continue;
+			sha1(score, b->data, b->dh.size);
+			if(memcmp(score, b->dh.score, Scoresize) != 0)
+				b->err = "score on disk invalid";
+		}
+		lock(&s->lock);
+		c->state = Sverified;
+		rwakeupall(&s->rendez);
+	}
+	unlock(&s->lock);
+	return nil;
+}
+
+
+int
+scan(Scan *s)
+{
+	pthread_t reader;
+	pthread_t *verifiers;
+	Scanchunk *c;
+	int i, j;
+
+	s->err = nil;
+	s->nread = s->nverify = s->ndone = 0;
+	s->eof = 0;
+	if(s->nproc <= 0)
+		s->nproc = 1;
+	if(!lockinit(&s->lock) || !rendezinit(&s->rendez, &s->lock))
+		errxsyslog(1, "init scan lock");
+
+	s->nchunks = s->nproc+2;
+	s->chunks = emalloc(sizeof s->chunks[0] * s->nchunks);
+	for(i = 0; i < s->nchunks; i++) {
+		c = &s->chunks[i];
+		c->buf = emalloc(Scanchunksize);
+		c->b = nil;
+		c->nb = c->nballoc = 0;
+		c->state = Sfree;
+	}
+
+	verifiers = emalloc(sizeof verifiers[0] * s->nproc);
+	if(pthread_create(&reader, nil, scanreader, s) != 0)
+		errsyslog(1, "creating scan reader");
+	for(i = 0; i < s->nproc; i++)
+		if(pthread_create(&verifiers[i], nil, scanverifier, s) != 0)
+			errsyslog(1, "creating scan verifier");
+
+	lock(&s->lock);
+	for(;;) {
+		c = &s->chunks[s->ndone % s->nchunks];
+		while(c->state != Sverified && !(s->eof && s->ndone == s->nread))
+			rsleep(&s->rendez);
+		if(c->state != Sverified)
+			break;
+		unlock(&s->lock);
+		for(i = 0; i < c->nb; i++) {
+			if(s->prefetch != nil && i == 0)
+				for(j = 0; j < MIN(Scanahead, c->nb); j++)
+					if(c->b[j].err == nil)
+						s->prefetch(s, &c->b[j]);
+			if(s->prefetch != nil && i+Scanahead < c->nb && c->b[i+Scanahead].err == nil)
+				s->prefetch(s, &c->b[i+Scanahead]);
+			s->fn(s, &c->b[i]);
+		}
+		lock(&s->lock);
+		c->state = Sfree;
+		s->ndone++;
+		rwakeupall(&s->rendez);
+	}
+	unlock(&s->lock);
+
+	pthread_join(reader, nil);
+	for(i = 0; i < s->nproc; i++)
+		pthread_join(verifiers[i], nil);
+	free(verifiers);
+	for(i = 0; i < s->nchunks; i++) {
+		free(s->chunks[i].buf);
+		free(s->chunks[i].b);
+	}
+	free(s->chunks);
+	s->chunks = nil;
+	return s->err == nil;
+}
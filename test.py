@@ -0,0 +1,373 @@
+#!/usr/bin/env python3
+
+# loopback tests:  start memventi on a fresh datafile, write blocks,
+# read them back, restart, read them again and run memventi-check.
+# and a follower that catches up with its primary after a restart,
+# the batch operations of the Codecbatch extension, and an import
+# into a sharded, aligned store with a coldfile.
+# run from the directory with the binaries, e.g. with "make test".
+
+import sys
+import os
+import socket
+import struct
+import hashlib
+import tempfile
+import shutil
+import subprocess
+import time
+import threading
+import signal
+
+
+Tping, Rping = 2, 3
+Thello, Rhello = 4, 5
+Tread, Rread = 12, 13
+Twrite, Rwrite = 14, 15
+Tsync, Rsync = 16, 17
+Tmread, Tmwrite = 64, 66
+Tmhave, Rmhave = 68, 69
+Rerror = 1
+Codecbatch = 0x6d
+
+bindir = os.path.dirname(os.path.abspath(sys.argv[0]))
+widths = ["12", "16", "30"]
+nblocks = 500
+running = []
+
+
+class Venti:
+	def __init__(self, port, codecs=b""):
+		self.s = socket.create_connection(("127.0.0.1", port))
+		self.f = self.s.makefile("rb")
+		self.f.readline()
+		self.s.sendall(b"venti-02-test\n")
+		self.tag = 0
+		r = self.rpc(Thello, self.string(b"02") + self.string(b"test") + b"\0\0" + bytes([len(codecs)]) + codecs)
+		self.codec = r[-1]
+
+	def close(self):
+		self.f.close()
+		self.s.close()
+
+	def string(self, s):
+		return struct.pack(">H", len(s)) + s
+
+	def rpc(self, op, body):
+		self.tag = (self.tag+1) & 0xff
+		m = bytes([op, self.tag]) + body
+		self.s.sendall(struct.pack(">H", len(m)) + m)
+		n = struct.unpack(">H", self.f.read(2))[0]
+		r = self.f.read(n)
+		if r[0] == Rerror:
+			n = struct.unpack(">H", r[2:4])[0]
+			raise VentiError(r[4:4+n].decode())
+		if r[0] != op+1 or r[1] != self.tag:
+			fail("bad reply, op %d tag %d for op %d tag %d" % (r[0], r[1], op, self.tag))
+		return r[2:]
+
+	def write(self, type, data):
+		return self.rpc(Twrite, bytes([type]) + b"\0\0\0" + data)
+
+	def read(self, score, type):
+		return self.rpc(Tread, score + bytes([type, 0]) + struct.pack(">H", 56*1024))
+
+	def sync(self):
+		self.rpc(Tsync, b"")
+
+	# send a batch of n entries, return the (op, body) of the nreply replies
+	def batch(self, op, n, body, nreply):
+		self.tag = (self.tag+1) & 0xff
+		m = bytes([op, self.tag]) + struct.pack(">H", n) + body
+		self.s.sendall(struct.pack(">H", len(m)) + m)
+		replies = []
+		for i in range(nreply):
+			r = self.f.read(struct.unpack(">H", self.f.read(2))[0])
+			if r[1] != self.tag:
+				fail("bad reply tag %d for batch op %d tag %d" % (r[1], op, self.tag))
+			replies.append((r[0], r[2:]))
+		return replies
+
+
+class VentiError(Exception):
+	pass
+
+
+def fail(msg):
+	print("FAIL: %s" % msg)
+	sys.exit(1)
+
+def block(i):
+	b = hashlib.sha1(str(i).encode()).digest() * 500
+	return b[:(i*7919) % 9000 + 1]
+
+def freeport():
+	s = socket.socket()
+	s.bind(("127.0.0.1", 0))
+	port = s.getsockname()[1]
+	s.close()
+	return port
+
+
+class Memventi:
+	def __init__(self, dir, args):
+		self.port = freeport()
+		self.log = open(os.path.join(dir, "log"), "a")
+		argv = [os.path.join(bindir, "memventi"), "-f", "-w", "127.0.0.1!%d" % self.port] + args + widths
+		self.p = subprocess.Popen(argv, cwd=dir, stdout=self.log, stderr=self.log)
+		running.append(self.p)
+		for i in range(100):
+			if self.p.poll() is not None:
+				fail("memventi exited with status %d, see %s" % (self.p.returncode, self.log.name))
+			try:
+				Venti(self.port).close()
+				return
+			except OSError:
+				time.sleep(0.1)
+		fail("memventi not listening on port %d" % self.port)
+
+	def stop(self):
+		running.remove(self.p)
+		self.p.terminate()
+		if self.p.wait() not in (0, -15):
+			fail("memventi exited with status %d" % self.p.returncode)
+		self.log.close()
+
+
+def writeblocks(v, lo, hi):
+	for i in range(lo, hi):
+		d = block(i)
+		score = v.write(i%3, d)
+		if score != hashlib.sha1(d).digest():
+			fail("bad score for block %d" % i)
+		if v.write(i%3, d) != score:
+			fail("bad score for duplicate of block %d" % i)
+	if v.write(0, b"") != hashlib.sha1(b"").digest():
+		fail("bad score for empty block")
+	v.sync()
+
+def readblocks(v, lo, hi):
+	for i in range(lo, hi):
+		d = block(i)
+		if v.read(hashlib.sha1(d).digest(), i%3) != d:
+			fail("bad data for block %d" % i)
+	try:
+		v.read(b"\1"*20, 0)
+		fail("read of missing block succeeded")
+	except VentiError as e:
+		if "no such" not in str(e):
+			fail("unexpected error for missing block: %s" % e)
+
+def waitblock(v, i):
+	d = block(i)
+	for j in range(100):
+		try:
+			if v.read(hashlib.sha1(d).digest(), i%3) == d:
+				return
+			fail("bad data for block %d" % i)
+		except VentiError:
+			time.sleep(0.1)
+	fail("block %d did not arrive" % i)
+
+def check(dir, args=[]):
+	p = subprocess.run([os.path.join(bindir, "memventi-check"), "-i", "index", "-d", "data"] + args,
+		cwd=dir, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, universal_newlines=True)
+	if p.returncode != 0 or " 0 invalid blocks" not in p.stdout:
+		fail("memventi-check:\n" + p.stdout)
+
+
+def testrestart(dir):
+	for f in ["data", "index"]:
+		open(os.path.join(dir, f), "w").close()
+	m = Memventi(dir, [])
+	v = Venti(m.port)
+	writeblocks(v, 0, nblocks)
+	readblocks(v, 0, nblocks)
+	v.close()
+	m.stop()
+
+	m = Memventi(dir, [])
+	v = Venti(m.port)
+	readblocks(v, 0, nblocks)
+	v.close()
+	m.stop()
+	check(dir)
+
+
+def testfollow(dir):
+	pdir = os.path.join(dir, "primary")
+	fdir = os.path.join(dir, "follower")
+	for d in [pdir, fdir]:
+		os.mkdir(d)
+		for f in ["data", "index"]:
+			open(os.path.join(d, f), "w").close()
+	p = Memventi(pdir, ["-y"])
+	pv = Venti(p.port)
+	follow = ["-F", "127.0.0.1!%d" % p.port]
+	f = Memventi(fdir, follow)
+	fv = Venti(f.port)
+
+	# once the follower is live, -y makes the blocks readable from it when the write returns
+	writeblocks(pv, 0, 1)
+	waitblock(fv, 0)
+	writeblocks(pv, 1, nblocks)
+	readblocks(fv, 0, nblocks)
+
+	# so is a duplicate, also while the first write of the block still waits for the follower
+	pv2 = Venti(p.port)
+	i = nblocks
+	scores = []
+	writers = [threading.Thread(target=lambda v: scores.append(v.write(i%3, block(i))), args=(v,)) for v in [pv, pv2]]
+	f.p.send_signal(signal.SIGSTOP)
+	for t in writers:
+		t.start()
+		time.sleep(0.5)
+	if not writers[1].is_alive():
+		f.p.send_signal(signal.SIGCONT)
+		fail("duplicate write answered before the follower had the block")
+	f.p.send_signal(signal.SIGCONT)
+	for t in writers:
+		t.join()
+	if scores != [hashlib.sha1(block(i)).digest()]*2:
+		fail("bad scores for concurrent writes of block %d" % i)
+	readblocks(fv, i, i+1)
+	pv2.close()
+	fv.close()
+	f.stop()
+
+	# the follower resumes from the position it saved
+	writeblocks(pv, nblocks+1, 2*nblocks)
+	f = Memventi(fdir, follow)
+	fv = Venti(f.port)
+	waitblock(fv, 2*nblocks-1)
+	readblocks(fv, 0, 2*nblocks)
+	starts = [l for l in open(os.path.join(fdir, "log")) if "following primary from offset=" in l]
+	if starts[-1].endswith("offset=0\n"):
+		fail("follower started over after restart")
+	fv.close()
+	f.stop()
+	pv.close()
+	p.stop()
+	check(fdir)
+
+
+def testbatch(dir):
+	for f in ["data", "index"]:
+		open(os.path.join(dir, f), "w").close()
+	m = Memventi(dir, [])
+	v = Venti(m.port, bytes([Codecbatch]))
+	if v.codec != Codecbatch:
+		fail("batch codec not negotiated")
+
+	# every write and read of a batch is answered on its own, in order.
+	# small blocks, the batch is a single message.
+	blocks = [block(i)[:500] for i in range(100)] + [b""]
+	body = b"".join(bytes([i%3, 0]) + struct.pack(">H", len(d)) + d for i, d in enumerate(blocks))
+	for i, (op, r) in enumerate(v.batch(Tmwrite, len(blocks), body, len(blocks))):
+		if op != Rwrite or r != hashlib.sha1(blocks[i]).digest():
+			fail("bad reply op %d for write %d of batch" % (op, i))
+	scores = [hashlib.sha1(d).digest() for d in blocks]
+	reads = [(scores[i], i%3) for i in range(len(blocks)-1)] + [(b"\1"*20, 0), (scores[-1], 1)]
+	body = b"".join(s + bytes([t, 0]) + struct.pack(">H", 56*1024) for s, t in reads)
+	replies = v.batch(Tmread, len(reads), body, len(reads))
+	for i, (op, r) in enumerate(replies[:-2]):
+		if op != Rread or r != blocks[i]:
+			fail("bad reply op %d for read %d of batch" % (op, i))
+	if replies[-2][0] != Rerror or b"no such" not in replies[-2][1]:
+		fail("missing block of batch not answered with an error")
+	if replies[-1] != (Rread, b""):
+		fail("bad reply for zero score in batch")
+	if v.read(scores[3], 0) != blocks[3]:
+		fail("bad data for read after batch")
+
+	# one bitmap for all scores, a present score with another type is missing
+	haves = []
+	for i in range(len(blocks)-1):
+		haves += [(scores[i], i%3, 1), (hashlib.sha1(b"missing %d" % i).digest(), i%3, 0), (scores[i], (i+1)%3, 0)]
+	haves.append((scores[-1], 5, 1))
+	body = b"".join(s + bytes([t, 0]) for s, t, _ in haves)
+	op, r = v.batch(Tmhave, len(haves), body, 1)[0]
+	if op != Rmhave or struct.unpack(">H", r[:2])[0] != len(haves) or len(r) != 2+(len(haves)+7)//8:
+		fail("bad reply op %d for have batch" % op)
+	for i, (s, t, want) in enumerate(haves):
+		if (r[2+i//8]>>(i%8)) & 1 != want:
+			fail("bad bit %d in have batch" % i)
+	v.close()
+
+	# clients that did not ask for the extension get their connection closed
+	v = Venti(m.port)
+	if v.codec != 0:
+		fail("batch codec negotiated without asking")
+	m2 = bytes([Tmread, 1]) + struct.pack(">H", 1) + scores[0] + bytes([0, 0]) + struct.pack(">H", 56*1024)
+	v.s.sendall(struct.pack(">H", len(m2)) + m2)
+	if v.f.read(2) != b"":
+		fail("batch without the codec answered")
+	v.close()
+	m.stop()
+	check(dir)
+
+
+def testimport(dir):
+	sdir = os.path.join(dir, "source")
+	ddir = os.path.join(dir, "dest")
+	os.mkdir(sdir)
+	os.mkdir(ddir)
+	for f in ["data", "index"]:
+		open(os.path.join(sdir, f), "w").close()
+	m = Memventi(sdir, [])
+	v = Venti(m.port)
+	writeblocks(v, 0, nblocks)
+	v.close()
+	m.stop()
+
+	# the second import finds all blocks present
+	layout = ["-s", "1m", "-S", "4", "-a", "512", "-c", "cold"]
+	for added in [nblocks, 0]:
+		with open(os.path.join(ddir, "log"), "a") as log:
+			p = subprocess.run([os.path.join(bindir, "memventi"), "-I", os.path.join(sdir, "data")] + layout + widths,
+				cwd=ddir, stdout=log, stderr=log)
+		if p.returncode != 0:
+			fail("import exited with status %d" % p.returncode)
+		last = open(os.path.join(ddir, "log")).readlines()[-1]
+		if ", %d blocks added" % added not in last:
+			fail("import: expected %d blocks added: %s" % (added, last))
+
+	m = Memventi(ddir, layout)
+	v = Venti(m.port)
+	readblocks(v, 0, nblocks)
+	writeblocks(v, nblocks, nblocks+100)
+	v.close()
+	m.stop()
+
+	m = Memventi(ddir, layout)
+	v = Venti(m.port)
+	readblocks(v, 0, nblocks+100)
+	v.close()
+	m.stop()
+	check(ddir, ["-s", "1m"])
+
+
+tests = [
+	("write, read, restart, check", testrestart),
+	("follower catches up after restart", testfollow),
+	("batch reads, writes and haves", testbatch),
+	("import into a sharded, aligned store", testimport),
+]
+
+def main():
+	for name, fn in tests:
+		dir = tempfile.mkdtemp(prefix="memventi-test.")
+		try:
+			fn(dir)
+		except:
+			print("FAIL: %s, files in %s" % (name, dir))
+			raise
+		finally:
+			for p in running:
+				p.kill()
+				p.wait()
+			del running[:]
+		shutil.rmtree(dir)
+		print("ok: %s" % name)
+
+main()
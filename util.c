@@ -10,27 +10,126 @@ sha1(uchar *score, uchar *data, uint len)
 	SHA1(data, len, score);
 }
 
-void *
-lockedmalloc(ulong len)
+/*
+ * memory for the index.  with Lockedhuge, allocations of at least a huge
+ * page are rounded to huge pages and mapped on explicit huge pages, or
+ * on normal pages aligned to huge pages and advised for transparent huge
+ * pages when none are available.  with Lockedinterleave, the pages are
+ * interleaved over the numa nodes.
+ */
+int lockedflags = 0;
+Lockedstats lockedstats;
+static Lock lockedstatslock = {PTHREAD_MUTEX_INITIALIZER};
+
+
+static ulong
+lockedlen(ulong len)
 {
-	void *p, *alignedp;
 	long pagesize;
-	static int mlockwarn = 0;
 
 	pagesize = sysconf(_SC_PAGESIZE);
 	if(pagesize == -1)
 		errsyslog(1, "sysconf pagesize");
-	len = roundup(len, pagesize);
-	p = malloc(len+pagesize-1);
-	if(p == nil)
+	if((lockedflags & Lockedhuge) && len >= Hugepagesize)
+		return roundup(len, Hugepagesize);
+	return roundup(len, pagesize);
+}
+
+
+/* map len bytes aligned to align */
+static void *
+alignedmap(ulong len, ulong align)
+{
+	uchar *p, *q;
+
+	p = mmap(nil, len+align, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+	if(p == MAP_FAILED)
 		return nil;
-	alignedp = (void*)(((uintptr_t)p + pagesize - 1)&~(pagesize-1));
-	if(mlock(alignedp, len) != 0 && mlockwarn == 0) {
-		syslog_r(LOG_WARNING, &sdata, "mlock failed on memory of len=%lu", len);
-		mlockwarn++;
+	q = (uchar *)roundup((uintptr_t)p, align);
+	if(q > p)
+		munmap(p, q-p);
+	if(q+len < p+len+align)
+		munmap(q+len, p+align-q);
+	return q;
+}
+
+
+static int
+interleave(void *p, ulong len)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+	ulong mask;
+
+	mask = ~0UL;
+	return syscall(SYS_mbind, p, len, MPOL_INTERLEAVE, &mask, 8*sizeof mask, 0) == 0;
+#else
+	errno = ENOSYS;
+	return 0;
+#endif
+}
+
+
+void *
+lockedmalloc(ulong len)
+{
+	void *p;
+	int huge, advised, interleaved, locked;
+
+	len = lockedlen(len);
+	p = nil;
+	huge = advised = 0;
+#ifdef MAP_HUGETLB
+	if((lockedflags & Lockedhuge) && len >= Hugepagesize) {
+		p = mmap(nil, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON|MAP_HUGETLB, -1, 0);
+		if(p == MAP_FAILED)
+			p = nil;
+		huge = p != nil;
+	}
+#endif
+	if(p == nil && (lockedflags & Lockedhuge) && len >= Hugepagesize) {
+		p = alignedmap(len, Hugepagesize);
+#ifdef MADV_HUGEPAGE
+		advised = p != nil && madvise(p, len, MADV_HUGEPAGE) == 0;
+#endif
 	}
+	if(p == nil) {
+		p = mmap(nil, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+		if(p == MAP_FAILED)
+			return nil;
+	}
+	interleaved = (lockedflags & Lockedinterleave) && interleave(p, len);
+	locked = mlock(p, len) == 0;
+
+	lock(&lockedstatslock);
+	if(!locked && lockedstats.mlockfailed++ == 0)
+		syslog_r(LOG_WARNING, &sdata, "mlock failed on memory of len=%lu", len);
+	if((lockedflags & Lockedhuge) && len >= Hugepagesize && !huge && lockedstats.hugefailed++ == 0)
+		syslog_r(LOG_WARNING, &sdata, "no huge pages available for memory of len=%lu, %s", len,
+			advised ? "advising transparent huge pages" : "using normal pages");
+	if((lockedflags & Lockedinterleave) && !interleaved && lockedstats.interleavefailed++ == 0)
+		syslog_r(LOG_WARNING, &sdata, "interleaving memory over numa nodes: %s", strerror(errno));
+	if(huge)
+		lockedstats.huge += len;
+	else if(advised)
+		lockedstats.advised += len;
+	else
+		lockedstats.plain += len;
+	if(interleaved)
+		lockedstats.interleaved += len;
+	unlock(&lockedstatslock);
+
 	debug(LOG_DEBUG, "lockedmalloc, %lu bytes allocated", len);
-	return alignedp;
+	return p;
+}
+
+void
+lockedfree(void *p, ulong len)
+{
+	if(p == nil)
+		return;
+	len = lockedlen(len);
+	munlock(p, len);
+	munmap(p, len);
 }
 
 void
@@ -98,7 +197,7 @@ uvlong
 roundup(uvlong n, uint round)
 {
 	assert((round & (round-1)) == 0);
-	return (n+round-1)&~(round-1);
+	return (n+round-1) & ~((uvlong)round-1);
 }
 
 
@@ -204,6 +303,24 @@ preadn(int fd, void *buf, size_t count, off_t offset)
 }
 
 
+ssize_t
+pwriten(int fd, void *buf, size_t count, off_t offset)
+{
+	ssize_t have, r;
+
+	have = 0;
+	while(count > have) {
+		r = pwrite(fd, (char *)buf+have, count-have, offset+have);
+		if(r < 0)
+			return r;
+		if(r == 0)
+			break;
+		have += r;
+	}
+	return have;
+}
+
+
 ssize_t
 writen(int fd, char *buf, size_t len)
 {
@@ -221,6 +338,32 @@ writen(int fd, char *buf, size_t len)
 }
 
 
+/* write all of iov, which is modified */
+ssize_t
+writevn(int fd, struct iovec *iov, int niov)
+{
+	ssize_t r, have;
+
+	have = 0;
+	while(niov > 0) {
+		r = writev(fd, iov, MIN(niov, IOV_MAX));
+		if(r < 0)
+			return r;
+		have += r;
+		while(niov > 0 && r >= iov[0].iov_len) {
+			r -= iov[0].iov_len;
+			iov++;
+			niov--;
+		}
+		if(niov > 0) {
+			iov[0].iov_base = (char *)iov[0].iov_base + r;
+			iov[0].iov_len -= r;
+		}
+	}
+	return have;
+}
+
+
 uvlong
 msec(void)
 {
@@ -278,3 +421,116 @@ wunlock(RWLock *l)
 {
 	runlock(l);
 }
+
+
+int
+rendezinit(Rendez *r, Lock *l)
+{
+	r->l = l;
+	return pthread_cond_init(&r->cond, nil) == 0;
+}
+
+void
+rsleep(Rendez *r)
+{
+	pthread_cond_wait(&r->cond, &r->l->lock);
+}
+
+/* like rsleep, but returns 0 when msec() passed deadline without a wakeup */
+int
+rsleepuntil(Rendez *r, uvlong deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline/1000;
+	ts.tv_nsec = (deadline%1000)*1000000;
+	return pthread_cond_timedwait(&r->cond, &r->l->lock, &ts) != ETIMEDOUT;
+}
+
+void
+rwakeup(Rendez *r)
+{
+	pthread_cond_signal(&r->cond);
+}
+
+void
+rwakeupall(Rendez *r)
+{
+	pthread_cond_broadcast(&r->cond);
+}
+
+
+/*
+ * pools keep up to maxfree objects of one size for reuse, so memory
+ * use stays flat when objects are allocated and freed at a steady
+ * rate.  objects come back from poolget as they were put, new objects
+ * are zeroed.  release is called for objects that are freed, to free
+ * what they point to.
+ */
+void
+poolinit(Pool *p, char *name, ulong size, ulong maxfree, void (*release)(void *))
+{
+	if(!lockinit(&p->lock))
+		errxsyslog(1, "init pool lock");
+	p->name = name;
+	p->size = size;
+	p->release = release;
+	p->free = emalloc(maxfree * sizeof p->free[0]);
+	p->nfree = 0;
+	p->maxfree = maxfree;
+	p->nused = p->nallocs = p->nreuses = 0;
+}
+
+
+/* nil when out of memory */
+void *
+poolget(Pool *p)
+{
+	void *v;
+
+	lock(&p->lock);
+	if(p->nfree > 0) {
+		v = p->free[--p->nfree];
+		p->nused++;
+		p->nreuses++;
+		unlock(&p->lock);
+		return v;
+	}
+	unlock(&p->lock);
+	v = malloc(p->size);
+	if(v == nil)
+		return nil;
+	memset(v, 0, p->size);
+	lock(&p->lock);
+	p->nused++;
+	p->nallocs++;
+	unlock(&p->lock);
+	return v;
+}
+
+
+void
+poolput(Pool *p, void *v)
+{
+	lock(&p->lock);
+	p->nused--;
+	if(p->nfree < p->maxfree) {
+		p->free[p->nfree++] = v;
+		unlock(&p->lock);
+		return;
+	}
+	unlock(&p->lock);
+	if(p->release != nil)
+		p->release(v);
+	free(v);
+}
+
+
+void
+poolstats(Pool *p)
+{
+	lock(&p->lock);
+	printf("pool %s: %lu in use, %lu free of %lu kept, %lu allocated, %lu reused, %lu bytes each\n",
+		p->name, p->nused, p->nfree, p->maxfree, p->nallocs, p->nreuses, p->size);
+	unlock(&p->lock);
+}